@@ -0,0 +1,239 @@
+/*
+	archive.c: multi-image archive, see archive.h
+
+	Adding an image takes an exclusive lock on the catalog, appends the
+	IMD to the pack, then appends the catalog entry, so concurrent
+	conversions can share one archive. Lookups map the catalog and scan
+	the fixed-size entries without touching the pack.
+*/
+
+#include "archive.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(cat_entry_t) == 256, "catalog entry size");
+
+typedef struct {
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t pad[5];
+} cat_header_t;
+
+static void arch_path(const char *arch, const char *ext, char *path) {
+	snprintf(path, PATH_MAX, "%s.%s", arch, ext);
+}
+
+static void write_all(int fd, const void *buf, size_t len, off_t off,
+			const char *name) {
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n <= 0) {
+			die_errno("cannot write %s", name);
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+}
+
+void archive_add(const char *arch, const char *imd_path, cat_entry_t *entry) {
+	char cat_name[PATH_MAX];
+	char pack_name[PATH_MAX];
+	struct stat stb;
+
+	arch_path(arch, "cat", cat_name);
+	arch_path(arch, "pack", pack_name);
+	int cat = open(cat_name, O_RDWR | O_CREAT, 0666);
+	if (cat < 0) {
+		die_errno("cannot open %s", cat_name);
+	}
+	if (flock(cat, LOCK_EX) < 0) {
+		die_errno("cannot lock %s", cat_name);
+	}
+	int pack = open(pack_name, O_RDWR | O_CREAT, 0666);
+	int imd = open(imd_path, O_RDONLY);
+	if (pack < 0 || imd < 0) {
+		die_errno("cannot open %s", pack < 0 ? pack_name : imd_path);
+	}
+	if (fstat(cat, &stb) < 0) {
+		die_errno("cannot stat %s", cat_name);
+	}
+	off_t cat_off = stb.st_size;
+	if (cat_off == 0) {
+		cat_header_t hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CAT_MAGIC, sizeof(CAT_MAGIC));
+		hdr.entry_size = sizeof(cat_entry_t);
+		write_all(cat, &hdr, sizeof(hdr), 0, cat_name);
+		cat_off = sizeof(hdr);
+	}
+	// entries are only complete once written; drop a torn tail
+	cat_off -= (cat_off - sizeof(cat_header_t)) % sizeof(cat_entry_t);
+
+	if (fstat(pack, &stb) < 0) {
+		die_errno("cannot stat %s", pack_name);
+	}
+	entry->offset = stb.st_size;
+	entry->length = 0;
+	uint8_t buf[65536];
+	ssize_t n;
+	while ((n = read(imd, buf, sizeof(buf))) > 0) {
+		write_all(pack, buf, n, entry->offset + entry->length,
+			pack_name);
+		entry->length += n;
+	}
+	if (n < 0) {
+		die_errno("cannot read %s", imd_path);
+	}
+	write_all(cat, entry, sizeof(*entry), cat_off, cat_name);
+	close(imd);
+	close(pack);
+	close(cat);	// releases the lock
+}
+
+typedef struct {
+	const uint8_t *map;
+	size_t len;
+	const cat_entry_t *entries;
+	size_t count;
+} catalog_t;
+
+static void map_catalog(const char *arch, catalog_t *c) {
+	char name[PATH_MAX];
+	struct stat stb;
+
+	arch_path(arch, "cat", name);
+	int fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stb) < 0) {
+		die_errno("cannot open %s", name);
+	}
+	c->len = stb.st_size;
+	if (c->len < sizeof(cat_header_t)) {
+		die("%s: not a catalog", name);
+	}
+	c->map = mmap(NULL, c->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		die_errno("cannot map %s", name);
+	}
+	close(fd);
+	const cat_header_t *hdr = (const cat_header_t *)c->map;
+	if (memcmp(hdr->magic, CAT_MAGIC, sizeof(CAT_MAGIC)) != 0 ||
+			hdr->entry_size != sizeof(cat_entry_t)) {
+		die("%s: not a catalog", name);
+	}
+	c->entries = (const cat_entry_t *)(c->map + sizeof(*hdr));
+	c->count = (c->len - sizeof(*hdr)) / sizeof(cat_entry_t);
+}
+
+// catalog strings fill their fields with no terminator when full
+static bool field_matches(const char *pat, const char *field, size_t len) {
+	char buf[sizeof(((cat_entry_t *)0)->name) + 1];
+	size_t n = strnlen(field, len < sizeof(buf) ? len : sizeof(buf) - 1);
+	memcpy(buf, field, n);
+	buf[n] = '\0';
+	return fnmatch(pat, buf, 0) == 0;
+}
+
+static bool matches(const cat_entry_t *e, const cat_query_t *q) {
+	if (q->match_hash && e->hash != q->hash) return false;
+	if (q->cylinders >= 0 && e->cylinders != q->cylinders) return false;
+	if (q->heads >= 0 && e->heads != q->heads) return false;
+	if (q->sectors >= 0 && e->sectors != q->sectors) return false;
+	if (q->sector_len >= 0 && e->sector_len != q->sector_len) return false;
+	if (q->name != NULL &&
+			!field_matches(q->name, e->name, sizeof(e->name))) {
+		return false;
+	}
+	if (q->title != NULL &&
+			!field_matches(q->title, e->title, sizeof(e->title))) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Prints matching entries, one per line:
+ * name, geometry (CxHxSxL), image hash, pack offset and length, title.
+ * Returns the number of matches.
+ */
+int archive_lookup(const char *arch, const cat_query_t *q, FILE *out) {
+	catalog_t c;
+	int found = 0;
+
+	map_catalog(arch, &c);
+	for (size_t i = 0; i < c.count; ++i) {
+		const cat_entry_t *e = &c.entries[i];
+		if (!matches(e, q)) continue;
+		fprintf(out, "%.*s %dx%dx%dx%d %016" PRIx64 " %" PRIu64
+			" %" PRIu64 " %.*s\n",
+			(int)sizeof(e->name), e->name, e->cylinders, e->heads,
+			e->sectors, e->sector_len, e->hash, e->offset,
+			e->length, (int)sizeof(e->title), e->title);
+		++found;
+	}
+	munmap((void *)c.map, c.len);
+	return found;
+}
+
+void archive_extract(const char *arch, const char *name, const char *out_path) {
+	char pack_name[PATH_MAX];
+	catalog_t c;
+	const cat_entry_t *e = NULL;
+
+	// longer names would match a stored name that starts the same way
+	if (strlen(name) >= sizeof(e->name)) {
+		die("%s: name too long for the catalog", name);
+	}
+	map_catalog(arch, &c);
+	// latest entry wins if a name was added more than once
+	for (size_t i = c.count; i-- > 0; ) {
+		if (strncmp(c.entries[i].name, name,
+				sizeof(c.entries[i].name)) == 0) {
+			e = &c.entries[i];
+			break;
+		}
+	}
+	if (e == NULL) {
+		die("%s: no image %s", arch, name);
+	}
+	arch_path(arch, "pack", pack_name);
+	int pack = open(pack_name, O_RDONLY);
+	if (pack < 0) {
+		die_errno("cannot open %s", pack_name);
+	}
+	FILE *out = fopen(out_path, "wb");
+	if (out == NULL) {
+		die_errno("cannot open %s", out_path);
+	}
+	uint8_t buf[65536];
+	uint64_t off = e->offset;
+	uint64_t left = e->length;
+	while (left > 0) {
+		size_t want = left < sizeof(buf) ? left : sizeof(buf);
+		ssize_t n = pread(pack, buf, want, off);
+		if (n < 0) {
+			die_errno("cannot read %s", pack_name);
+		}
+		if (n == 0) {
+			die("%s: truncated", pack_name);
+		}
+		fwrite(buf, 1, n, out);
+		off += n;
+		left -= n;
+	}
+	if (fclose(out) != 0) {
+		die_errno("cannot write %s", out_path);
+	}
+	close(pack);
+	munmap((void *)c.map, c.len);
+}
@@ -0,0 +1,49 @@
+/*
+	archive.h: multi-image archive with a memory-mappable catalog
+
+	ARCH.pack	IMD files, concatenated
+	ARCH.cat	catalog header + fixed-size entries (host byte order)
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAT_MAGIC	"IMDCAT1"
+
+typedef struct {
+	char name[128];
+	char title[72];		// first comment line after the IMD header
+	uint64_t offset;	// in ARCH.pack
+	uint64_t length;
+	uint64_t hash;		// image hash, as --manifest/--verify
+	uint16_t cylinders;
+	uint8_t heads;
+	uint8_t policy;
+	uint16_t sectors;
+	uint16_t sector_len;
+	uint8_t dmode;		// DATA_MODES[] index
+	uint8_t offset1;
+	uint8_t offset2;
+	uint8_t pad[21];
+} cat_entry_t;
+
+typedef struct {
+	int cylinders;		// < 0: any
+	int heads;
+	int sectors;
+	int sector_len;
+	const char *title;	// fnmatch pattern, NULL: any
+	const char *name;
+	bool match_hash;
+	uint64_t hash;
+} cat_query_t;
+
+void archive_add(const char *arch, const char *imd_path, cat_entry_t *entry);
+int archive_lookup(const char *arch, const cat_query_t *q, FILE *out);
+void archive_extract(const char *arch, const char *name, const char *out_path);
+
+#endif
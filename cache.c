@@ -0,0 +1,183 @@
+/*
+	cache.c: batch up-to-date cache, see cache.h
+
+	The cache is a text file, one entry per line, appended to as
+	conversions finish (by several processes at once: each entry is a
+	single O_APPEND write). A later entry for the same output replaces
+	an earlier one; cache_compact() rewrites the file with just the
+	latest entries.
+
+		c1 SIZE MTIME_NS INO CONTENT PARAMS OUT_SIZE OUTPUT-PATH
+*/
+
+#include "cache.h"
+#include "hash.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC	"c1"
+
+static size_t slot_of(const cache_t *c, const char *out) {
+	size_t i = hash64(out, strlen(out), 0) & (c->nslots - 1);
+	while (c->slots[i] != SIZE_MAX &&
+			strcmp(c->ents[c->slots[i]].out, out) != 0) {
+		i = (i + 1) & (c->nslots - 1);
+	}
+	return i;
+}
+
+static void rehash(cache_t *c) {
+	free(c->slots);
+	c->nslots = 64;
+	while (c->nslots < c->n * 2) c->nslots *= 2;
+	c->slots = malloc(c->nslots * sizeof(*c->slots));
+	if (c->slots == NULL) {
+		die("out of memory");
+	}
+	memset(c->slots, 0xff, c->nslots * sizeof(*c->slots));
+	for (size_t i = 0; i < c->n; ++i) {
+		c->slots[slot_of(c, c->ents[i].out)] = i;
+	}
+}
+
+static void put(cache_t *c, const cache_entry_t *e) {
+	if (c->n * 2 >= c->nslots) rehash(c);
+	size_t s = slot_of(c, e->out);
+	if (c->slots[s] != SIZE_MAX) {	// newer entry wins
+		const char *out = c->ents[c->slots[s]].out;
+		c->ents[c->slots[s]] = *e;
+		c->ents[c->slots[s]].out = out;
+		free((char *)e->out);
+		return;
+	}
+	if (c->n == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 256;
+		c->ents = realloc(c->ents, c->cap * sizeof(*c->ents));
+		if (c->ents == NULL) {
+			die("out of memory");
+		}
+	}
+	c->ents[c->n] = *e;
+	c->slots[s] = c->n++;
+}
+
+static void load(cache_t *c, const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT) {
+			die_errno("cannot open %s", path);
+		}
+		return;
+	}
+	char line[PATH_MAX + 256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		cache_entry_t e;
+		int pos = 0;
+		size_t len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n') continue;	// torn
+		line[len - 1] = '\0';
+		if (sscanf(line, CACHE_MAGIC " %" SCNx64 " %" SCNx64 " %"
+				SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64 " %n",
+				&e.size, &e.mtime_ns, &e.ino, &e.content,
+				&e.params, &e.out_size, &pos) != 6 || pos == 0) {
+			continue;
+		}
+		e.out = strdup(line + pos);
+		if (e.out == NULL) {
+			die("out of memory");
+		}
+		put(c, &e);
+	}
+	fclose(f);
+}
+
+void cache_open(cache_t *c, const char *path) {
+	memset(c, 0, sizeof(*c));
+	c->path = strdup(path);
+	if (c->path == NULL) {
+		die("out of memory");
+	}
+	rehash(c);
+	load(c, c->path);
+}
+
+// adds the entries of another cache file, e.g. one written by a shard
+void cache_merge(cache_t *c, const char *path) {
+	load(c, path);
+}
+
+const cache_entry_t *cache_find(const cache_t *c, const char *out) {
+	size_t s = slot_of(c, out);
+	return c->slots[s] == SIZE_MAX ? NULL : &c->ents[c->slots[s]];
+}
+
+static int format(const cache_entry_t *e, char *buf, size_t len) {
+	return snprintf(buf, len, CACHE_MAGIC " %" PRIx64 " %" PRIx64 " %"
+		PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %s\n",
+		e->size, e->mtime_ns, e->ino, e->content, e->params,
+		e->out_size, e->out);
+}
+
+// safe from concurrent processes: one write() with O_APPEND
+void cache_append(const char *path, const cache_entry_t *e) {
+	char buf[PATH_MAX + 256];
+	if (strchr(e->out, '\n') != NULL) return;
+	int n = format(e, buf, sizeof(buf));
+	if (n >= (int)sizeof(buf)) return;
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (fd < 0) {
+		die_errno("cannot open %s", path);
+	}
+	if (write(fd, buf, n) != n) {
+		die_errno("cannot write %s", path);
+	}
+	close(fd);
+}
+
+/*
+ * Picks up entries appended since cache_open() and rewrites the file
+ * with the latest entry per output, via a temporary file.
+ */
+void cache_compact(cache_t *c) {
+	char tmp[PATH_MAX + 8];
+	char buf[PATH_MAX + 256];
+	load(c, c->path);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", c->path);
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		die_errno("cannot create %s", tmp);
+	}
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL) {
+		die_errno("cannot create %s", tmp);
+	}
+	for (size_t i = 0; i < c->n; ++i) {
+		if (strchr(c->ents[i].out, '\n') != NULL) continue;
+		format(&c->ents[i], buf, sizeof(buf));
+		fputs(buf, f);
+	}
+	if (fclose(f) != 0) {
+		die_errno("cannot write %s", tmp);
+	}
+	if (rename(tmp, c->path) < 0) {
+		die_errno("cannot rename %s", tmp);
+	}
+}
+
+void cache_close(cache_t *c) {
+	for (size_t i = 0; i < c->n; ++i) {
+		free((char *)c->ents[i].out);
+	}
+	free(c->ents);
+	free(c->slots);
+	free(c->path);
+	memset(c, 0, sizeof(*c));
+}
@@ -0,0 +1,43 @@
+/*
+	cache.h: up-to-date cache for batch conversion
+
+	For each output it records the identity of the input it was made
+	from (size, mtime, inode, optionally a content hash), a hash of the
+	conversion parameters and the output's size. An output whose entry
+	still matches is current and need not be converted again.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	const char *out;	// output path, the key
+	uint64_t size;		// input identity
+	uint64_t mtime_ns;
+	uint64_t ino;
+	uint64_t content;	// input hash64, 0: not taken
+	uint64_t params;	// conversion parameters hash
+	uint64_t out_size;
+} cache_entry_t;
+
+typedef struct {
+	char *path;
+	cache_entry_t *ents;
+	size_t n;
+	size_t cap;
+	size_t *slots;		// open-addressed index into ents, by out
+	size_t nslots;
+} cache_t;
+
+void cache_open(cache_t *c, const char *path);
+void cache_merge(cache_t *c, const char *path);
+const cache_entry_t *cache_find(const cache_t *c, const char *out);
+void cache_append(const char *path, const cache_entry_t *e);
+void cache_compact(cache_t *c);
+void cache_close(cache_t *c);
+
+#endif
@@ -0,0 +1,371 @@
+/*
+	cpm.c: CP/M filesystem access, see cpm.h
+*/
+
+#include "cpm.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Guesses a disk parameter block from the disk size, for when none
+ * is given: 64 directory entries, 2 reserved tracks, 1K blocks up to
+ * 256K of data and 2K blocks above.
+ */
+void cpm_default_dpb(cpm_disk_t *d) {
+	if (d->dirents <= 0) d->dirents = 64;
+	if (d->off < 0) d->off = 2;
+	if (d->bls <= 0) {
+		size_t tsize = (size_t)d->spt * d->seclen;
+		size_t tracks = tsize ? d->size / tsize : 0;
+		size_t data = tracks > d->off ? (tracks - d->off) * tsize : 0;
+		d->bls = data <= 256 * 1024 ? 1024 : 2048;
+	}
+}
+
+// returns -1 if the parameters do not fit the image
+int cpm_init(cpm_disk_t *d) {
+	size_t tsize = (size_t)d->spt * d->seclen;
+	if (tsize == 0 || d->bls < 1024 || (d->bls & (d->bls - 1)) != 0 ||
+			d->dirents <= 0 || d->off < 0) {
+		return -1;
+	}
+	d->tracks = d->size / tsize;
+	if (d->tracks <= d->off) return -1;
+	size_t data = (size_t)(d->tracks - d->off) * tsize;
+	if (data / d->bls < 2) return -1;
+	d->dsm = data / d->bls - 1;
+	d->wide = d->dsm > 255;
+	if ((size_t)d->dirents * CPM_DIRENT > data) return -1;
+	return 0;
+}
+
+/*
+ * Reads 'len' bytes at logical position 'pos' of the data area
+ * (after the reserved tracks), gathering runs of raw-adjacent sectors
+ * into single copies. Returns the number of bytes read.
+ */
+size_t cpm_read(const cpm_disk_t *d, size_t pos, size_t len, uint8_t *out) {
+	size_t tsize = (size_t)d->spt * d->seclen;
+	size_t done = 0;
+	while (done < len) {
+		size_t lpos = pos + done;
+		size_t trk = d->off + lpos / tsize;
+		if (trk >= d->tracks) break;
+		int ls = (lpos % tsize) / d->seclen;
+		size_t in_sec = lpos % d->seclen;
+		int rs = d->xlt ? d->xlt[ls] : ls;
+		size_t src = trk * tsize + (size_t)rs * d->seclen + in_sec;
+		size_t n = d->seclen - in_sec;
+		// extend over following sectors that are also raw-adjacent
+		while (ls + 1 < d->spt && done + n < len &&
+				(d->xlt ? d->xlt[ls + 1] : ls + 1) == rs + 1) {
+			++ls;
+			++rs;
+			n += d->seclen;
+		}
+		if (n > len - done) n = len - done;
+		memcpy(out + done, d->image + src, n);
+		done += n;
+	}
+	return done;
+}
+
+size_t cpm_read_block(const cpm_disk_t *d, int block, uint8_t *out) {
+	return cpm_read(d, (size_t)block * d->bls, d->bls, out);
+}
+
+typedef struct {
+	const uint8_t *ent;
+	int extent;		// S2 * 32 + EX
+} dirent_ref_t;
+
+static int cmp_dirent(const void *a, const void *b) {
+	const dirent_ref_t *x = a;
+	const dirent_ref_t *y = b;
+	// user + name + ext, then extent
+	int c = memcmp(x->ent, y->ent, 1);
+	if (c) return c;
+	for (int i = 1; i < 12; ++i) {
+		c = (x->ent[i] & 0x7f) - (y->ent[i] & 0x7f);
+		if (c) return c;
+	}
+	return x->extent - y->extent;
+}
+
+static bool same_file(const uint8_t *a, const uint8_t *b) {
+	if (a[0] != b[0]) return false;
+	for (int i = 1; i < 12; ++i) {
+		if ((a[i] & 0x7f) != (b[i] & 0x7f)) return false;
+	}
+	return true;
+}
+
+static void file_name(const uint8_t *ent, char *name) {
+	int n = 0;
+	for (int i = 1; i < 9 && (ent[i] & 0x7f) != ' '; ++i) {
+		name[n++] = ent[i] & 0x7f;
+	}
+	if ((ent[9] & 0x7f) != ' ') {
+		name[n++] = '.';
+		for (int i = 9; i < 12 && (ent[i] & 0x7f) != ' '; ++i) {
+			name[n++] = ent[i] & 0x7f;
+		}
+	}
+	name[n] = '\0';
+	// keep names usable as host file names
+	for (int i = 0; i < n; ++i) {
+		if (name[i] == '/' || name[i] < ' ' || name[i] == 0x7f) {
+			name[i] = '_';
+		}
+	}
+}
+
+/*
+ * Reads the directory once and groups its entries into files.
+ * Returns the number of files; *files must be freed with
+ * cpm_free_files().
+ */
+int cpm_files(const cpm_disk_t *d, cpm_file_t **files) {
+	size_t dlen = (size_t)d->dirents * CPM_DIRENT;
+	uint8_t *dir = malloc(dlen);
+	dirent_ref_t *refs = malloc(d->dirents * sizeof(*refs));
+	if (dir == NULL || refs == NULL) {
+		die("out of memory");
+	}
+	dlen = cpm_read(d, 0, dlen, dir);
+	int nrefs = 0;
+	for (size_t i = 0; i + CPM_DIRENT <= dlen; i += CPM_DIRENT) {
+		const uint8_t *e = dir + i;
+		if (e[0] > 15) continue;	// deleted, label, timestamps
+		refs[nrefs].ent = e;
+		refs[nrefs].extent = (e[14] & 0x3f) * 32 + (e[12] & 0x1f);
+		++nrefs;
+	}
+	qsort(refs, nrefs, sizeof(*refs), cmp_dirent);
+
+	int nfiles = 0;
+	cpm_file_t *f = calloc(nrefs ? nrefs : 1, sizeof(*f));
+	if (f == NULL) {
+		die("out of memory");
+	}
+	int per = d->wide ? 8 : 16;
+	for (int i = 0; i < nrefs; ) {
+		cpm_file_t *cf = &f[nfiles++];
+		cf->user = refs[i].ent[0];
+		file_name(refs[i].ent, cf->name);
+		int j = i;
+		while (j < nrefs && same_file(refs[i].ent, refs[j].ent)) ++j;
+		cf->blocks = malloc((j - i) * per * sizeof(uint16_t));
+		if (cf->blocks == NULL) {
+			die("out of memory");
+		}
+		for (int k = i; k < j; ++k) {
+			const uint8_t *al = refs[k].ent + 16;
+			for (int b = 0; b < per; ++b) {
+				int blk = d->wide ? al[b * 2] | (al[b * 2 + 1] << 8)
+						: al[b];
+				if (blk != 0 && blk <= d->dsm) {
+					cf->blocks[cf->nblocks++] = blk;
+				}
+			}
+		}
+		// size from the last extent: extents before it are full
+		const uint8_t *last = refs[j - 1].ent;
+		size_t recs = (size_t)refs[j - 1].extent * 128 + last[15];
+		size_t max = (size_t)cf->nblocks * d->bls;
+		cf->size = recs * 128 < max ? recs * 128 : max;
+		i = j;
+	}
+	free(refs);
+	free(dir);
+	*files = f;
+	return nfiles;
+}
+
+void cpm_free_files(cpm_file_t *files, int n) {
+	for (int i = 0; i < n; ++i) {
+		free(files[i].blocks);
+	}
+	free(files);
+}
+
+/*
+ * Extracts all files into 'dir', user 0 at the top and other user
+ * areas in subdirectories "uN". Returns the number of files.
+ */
+int cpm_extract(const cpm_disk_t *d, const char *dir, bool verbose) {
+	cpm_file_t *files;
+	char path[PATH_MAX];
+	uint8_t *buf = malloc(d->bls);
+	if (buf == NULL) {
+		die("out of memory");
+	}
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		die_errno("cannot create %s", dir);
+	}
+	int n = cpm_files(d, &files);
+	for (int i = 0; i < n; ++i) {
+		const cpm_file_t *cf = &files[i];
+		if (cf->user == 0) {
+			snprintf(path, sizeof(path), "%s/%s", dir, cf->name);
+		} else {
+			snprintf(path, sizeof(path), "%s/u%d", dir, cf->user);
+			if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+				die_errno("cannot create %s", path);
+			}
+			snprintf(path, sizeof(path), "%s/u%d/%s", dir,
+				cf->user, cf->name);
+		}
+		FILE *out = fopen(path, "wb");
+		if (out == NULL) {
+			die_errno("cannot open %s", path);
+		}
+		size_t left = cf->size;
+		for (int b = 0; b < cf->nblocks && left > 0; ++b) {
+			size_t got = cpm_read_block(d, cf->blocks[b], buf);
+			if (got > left) got = left;
+			fwrite(buf, 1, got, out);
+			left -= got;
+		}
+		if (fclose(out) != 0) {
+			die_errno("cannot write %s", path);
+		}
+		if (verbose) {
+			printf("%s: %d:%s %zu\n", dir, cf->user, cf->name,
+				cf->size);
+		}
+	}
+	cpm_free_files(files, n);
+	free(buf);
+	return n;
+}
+
+/*
+ * Builds a byte-pair model, log P(b | a), from the pairs inside each
+ * sector of the data area. Sector order does not affect it, so one
+ * model serves every skew candidate.
+ */
+void cpm_model(const cpm_disk_t *d, cpm_model_t *m) {
+	static uint32_t count[256][256];
+	uint32_t row[256];
+	size_t tsize = (size_t)d->spt * d->seclen;
+	const uint8_t *p = d->image + (size_t)d->off * tsize;
+	const uint8_t *end = d->image + (size_t)d->tracks * tsize;
+
+	memset(count, 0, sizeof(count));
+	memset(row, 0, sizeof(row));
+	for (; p < end; p += d->seclen) {
+		for (int i = 1; i < d->seclen; ++i) {
+			++count[p[i - 1]][p[i]];
+			++row[p[i - 1]];
+		}
+	}
+	double sum = 0;
+	size_t pairs = 0;
+	for (int a = 0; a < 256; ++a) {
+		for (int b = 0; b < 256; ++b) {
+			double lp = log((count[a][b] + 0.1) / (row[a] + 25.6));
+			m->lp[a * 256 + b] = lp;
+			sum += lp * count[a][b];
+			pairs += count[a][b];
+		}
+	}
+	m->mean = pairs ? sum / pairs : 0;
+}
+
+static bool valid_dirent(const cpm_disk_t *d, const uint8_t *e) {
+	for (int i = 1; i < 12; ++i) {
+		int c = e[i] & 0x7f;
+		if (c < ' ' || c == 0x7f || (c >= 'a' && c <= 'z')) {
+			return false;
+		}
+	}
+	if (e[12] > 31 || e[15] > 128) return false;
+	int per = d->wide ? 8 : 16;
+	for (int b = 0; b < per; ++b) {
+		const uint8_t *al = e + 16;
+		int blk = d->wide ? al[b * 2] | (al[b * 2 + 1] << 8) : al[b];
+		if (blk > d->dsm) return false;
+	}
+	return true;
+}
+
+// text file whose last record is ^Z-filled, as CP/M editors leave it
+static bool text_eof(const uint8_t *rec) {
+	int i = 0;
+	while (i < 128 && rec[i] != 0x1a) {
+		if (rec[i] < ' ' && rec[i] != '\r' && rec[i] != '\n' &&
+				rec[i] != '\t') {
+			return false;
+		}
+		++i;
+	}
+	if (i == 128) return false;
+	while (i < 128 && rec[i] == 0x1a) ++i;
+	return i == 128;
+}
+
+/*
+ * Scores how coherent the filesystem looks through d->xlt: plausible
+ * directory entries, files whose sector boundaries join like the
+ * byte pairs inside sectors do, and text files ending in ^Z fill.
+ * Higher is better; only differences between candidates matter.
+ */
+double cpm_score(const cpm_disk_t *d, const cpm_model_t *m) {
+	size_t dlen = (size_t)d->dirents * CPM_DIRENT;
+	uint8_t *dir = malloc(dlen);
+	if (dir == NULL) {
+		die("out of memory");
+	}
+	dlen = cpm_read(d, 0, dlen, dir);
+	double score = 0;
+	for (size_t i = 0; i + CPM_DIRENT <= dlen; i += CPM_DIRENT) {
+		const uint8_t *e = dir + i;
+		if (e[0] == 0xe5) continue;
+		if (e[0] <= 15 && valid_dirent(d, e)) {
+			score += 8;
+		} else if (e[0] != 0x20 && e[0] != 0x21) {
+			score -= 32;
+		}
+	}
+	free(dir);
+
+	cpm_file_t *files;
+	int n = cpm_files(d, &files);
+	uint8_t *buf = malloc(d->bls);
+	uint8_t last = 0;
+	if (buf == NULL) {
+		die("out of memory");
+	}
+	for (int i = 0; i < n; ++i) {
+		size_t pos = 0;
+		for (int b = 0; b < files[i].nblocks && pos < files[i].size;
+				++b) {
+			size_t len = cpm_read_block(d, files[i].blocks[b], buf);
+			if (len > files[i].size - pos) len = files[i].size - pos;
+			for (size_t k = 0; k < len; k += d->seclen) {
+				if (pos + k > 0) {
+					score += m->lp[last * 256 + buf[k]] - m->mean;
+				}
+				if (k + d->seclen <= len) {
+					last = buf[k + d->seclen - 1];
+				}
+			}
+			if (pos + len == files[i].size && len >= 128 &&
+					text_eof(buf + len - 128)) {
+				score += 4;
+			}
+			pos += len;
+		}
+	}
+	free(buf);
+	cpm_free_files(files, n);
+	return score;
+}
@@ -0,0 +1,58 @@
+/*
+	cpm.h: CP/M filesystem access on flat disk images
+
+	The image must be in CP/M track order, which is the order of
+	tracks in a raw/logdisk file. Logical sectors within a track are
+	mapped to raw sectors through the logical skew table (xlt).
+*/
+
+#ifndef CPM_H
+#define CPM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	// image and geometry
+	const uint8_t *image;
+	size_t size;
+	int spt;		// sectors per track
+	int seclen;		// sector length
+	const int *xlt;		// logical -> raw sector, NULL: 1:1
+	// disk parameter block
+	int bls;		// block size
+	int dirents;		// directory entries (DRM + 1)
+	int off;		// reserved tracks
+	// derived by cpm_init()
+	int tracks;
+	int dsm;		// last block number
+	bool wide;		// 16-bit block pointers
+} cpm_disk_t;
+
+typedef struct {
+	int user;
+	char name[13];		// "NAME.EXT"
+	size_t size;		// bytes (128-byte record granularity)
+	int nblocks;
+	uint16_t *blocks;
+} cpm_file_t;
+
+#define CPM_DIRENT	32
+
+typedef struct {
+	float lp[256 * 256];	// log P(b | a), at [a * 256 + b]
+	double mean;		// average over pairs inside sectors
+} cpm_model_t;
+
+int cpm_init(cpm_disk_t *d);
+void cpm_default_dpb(cpm_disk_t *d);
+size_t cpm_read(const cpm_disk_t *d, size_t pos, size_t len, uint8_t *out);
+size_t cpm_read_block(const cpm_disk_t *d, int block, uint8_t *out);
+int cpm_files(const cpm_disk_t *d, cpm_file_t **files);
+void cpm_free_files(cpm_file_t *files, int n);
+int cpm_extract(const cpm_disk_t *d, const char *dir, bool verbose);
+void cpm_model(const cpm_disk_t *d, cpm_model_t *m);
+double cpm_score(const cpm_disk_t *d, const cpm_model_t *m);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+	delta.c: sector-level IMD deltas, see delta.h
+
+	Delta file layout (integers little-endian):
+		"IMDDELTA1\n"
+		u64	hash of the whole base IMD file
+		u32	comment length (including 0x1A), comment bytes
+		then one entry per track of the new image, in order:
+		'K' cyl head		base track unchanged
+		'P' cyl head count	base track with 'count' sector records
+			{ u8 index, u32 length, record } replaced
+		'T' u32 length, record	literal track record
+		'E'			end
+
+	Tracks are matched by cylinder/head. Equal track record hashes
+	mean the track is kept without comparing bytes; a track whose
+	header and sector maps match the base is patched sector by sector;
+	anything else is stored literally.
+*/
+
+#include "delta.h"
+#include "hash.h"
+#include "imdfile.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DELTA_MAGIC	"IMDDELTA1\n"
+#define MAX_TRACKS	(256 * 16)
+
+typedef struct {
+	imd_track_t track;
+	uint64_t hash;
+} base_track_t;
+
+static void put_u32(uint32_t v, FILE *out) {
+	for (int i = 0; i < 4; ++i) {
+		fputc((v >> (i * 8)) & 0xff, out);
+	}
+}
+
+static void put_u64(uint64_t v, FILE *out) {
+	put_u32(v, out);
+	put_u32(v >> 32, out);
+}
+
+static base_track_t **index_base(imd_file_t *base) {
+	base_track_t **idx = calloc(MAX_TRACKS, sizeof(*idx));
+	imd_track_t trk;
+	if (idx == NULL) {
+		die("out of memory");
+	}
+	while (imd_next_track(base, &trk)) {
+		base_track_t **b = &idx[trk.cyl * 16 + trk.head];
+		if (*b != NULL) continue;
+		*b = malloc(sizeof(**b));
+		if (*b == NULL) {
+			die("out of memory");
+		}
+		(*b)->track = trk;
+		(*b)->hash = hash64(trk.start, trk.len, 0);
+	}
+	return idx;
+}
+
+static void free_index(base_track_t **idx) {
+	for (int i = 0; i < MAX_TRACKS; ++i) {
+		free(idx[i]);
+	}
+	free(idx);
+}
+
+// bytes before the first sector record: mode, cyl, head, count, maps
+static size_t layout_len(const imd_track_t *trk) {
+	if (trk->num_sectors == 0) return trk->len;
+	return trk->rec[0] - trk->start;
+}
+
+static size_t rec_len(const imd_track_t *trk, int i) {
+	const uint8_t *next = (i + 1 < trk->num_sectors) ?
+		trk->rec[i + 1] : trk->start + trk->len;
+	return next - trk->rec[i];
+}
+
+void delta_imd(const char *base_path, const char *imd_path,
+		const char *out_path, bool verbose) {
+	imd_file_t base;
+	imd_file_t img;
+	imd_track_t trk;
+	int kept = 0;
+	int patched = 0;
+	int literal = 0;
+	int sectors = 0;
+
+	imd_open(&base, base_path);
+	imd_open(&img, imd_path);
+	base_track_t **idx = index_base(&base);
+	FILE *out = fopen(out_path, "wb");
+	if (out == NULL) {
+		die_errno("cannot open %s", out_path);
+	}
+	fputs(DELTA_MAGIC, out);
+	put_u64(hash64(base.buf, base.len, 0), out);
+	put_u32(img.comment_len + 1, out);
+	fwrite(img.buf, 1, img.comment_len + 1, out);
+
+	while (imd_next_track(&img, &trk)) {
+		base_track_t *b = idx[trk.cyl * 16 + trk.head];
+		if (b != NULL && b->track.len == trk.len &&
+				b->hash == hash64(trk.start, trk.len, 0)) {
+			fputc('K', out);
+			fputc(trk.cyl, out);
+			fputc(trk.head, out);
+			++kept;
+			continue;
+		}
+		size_t ll = layout_len(&trk);
+		if (b == NULL || layout_len(&b->track) != ll ||
+				memcmp(b->track.start, trk.start, ll) != 0) {
+			fputc('T', out);
+			put_u32(trk.len, out);
+			fwrite(trk.start, 1, trk.len, out);
+			++literal;
+			continue;
+		}
+		int count = 0;
+		for (int i = 0; i < trk.num_sectors; ++i) {
+			size_t l = rec_len(&trk, i);
+			if (l != rec_len(&b->track, i) ||
+				memcmp(trk.rec[i], b->track.rec[i], l) != 0) {
+				++count;
+			}
+		}
+		fputc('P', out);
+		fputc(trk.cyl, out);
+		fputc(trk.head, out);
+		fputc(count, out);
+		for (int i = 0; i < trk.num_sectors; ++i) {
+			size_t l = rec_len(&trk, i);
+			if (l != rec_len(&b->track, i) ||
+				memcmp(trk.rec[i], b->track.rec[i], l) != 0) {
+				fputc(i, out);
+				put_u32(l, out);
+				fwrite(trk.rec[i], 1, l, out);
+			}
+		}
+		sectors += count;
+		++patched;
+	}
+	fputc('E', out);
+	if (fclose(out) != 0) {
+		die_errno("cannot write %s", out_path);
+	}
+	if (verbose) {
+		printf("%s: %d tracks kept, %d patched (%d sectors), "
+			"%d literal\n", out_path, kept, patched, sectors, literal);
+	}
+	free_index(idx);
+	imd_close(&img);
+	imd_close(&base);
+}
+
+typedef struct {
+	const char *name;
+	uint8_t *buf;
+	size_t len;
+	size_t pos;
+} reader_t;
+
+static const uint8_t *take(reader_t *r, size_t n) {
+	if (r->len - r->pos < n) {
+		die("%s: truncated delta", r->name);
+	}
+	const uint8_t *p = r->buf + r->pos;
+	r->pos += n;
+	return p;
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	size_t max;
+} image_t;
+
+static void append(image_t *img, const uint8_t *p, size_t n) {
+	if (img->len + n > img->max) {
+		while (img->len + n > img->max) {
+			img->max = img->max ? img->max * 2 : 65536;
+		}
+		img->buf = realloc(img->buf, img->max);
+		if (img->buf == NULL) {
+			die("out of memory");
+		}
+	}
+	memcpy(img->buf + img->len, p, n);
+	img->len += n;
+}
+
+static uint32_t get_u32(reader_t *r) {
+	const uint8_t *p = take(r, 4);
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(reader_t *r) {
+	uint64_t lo = get_u32(r);
+	return lo | ((uint64_t)get_u32(r) << 32);
+}
+
+static void read_file(reader_t *r, const char *name) {
+	FILE *f = fopen(name, "rb");
+	if (f == NULL) {
+		die_errno("cannot open %s", name);
+	}
+	r->name = name;
+	r->buf = NULL;
+	r->len = 0;
+	r->pos = 0;
+	size_t max = 0;
+	while (true) {
+		if (r->len == max) {
+			max = max ? max * 2 : 65536;
+			r->buf = realloc(r->buf, max);
+			if (r->buf == NULL) {
+				die("out of memory");
+			}
+		}
+		size_t n = fread(r->buf + r->len, 1, max - r->len, f);
+		if (n == 0) break;
+		r->len += n;
+	}
+	if (ferror(f)) {
+		die_errno("cannot read %s", name);
+	}
+	fclose(f);
+}
+
+void undelta_imd(const char *base_path, const char *delta_path,
+		const char *out_path, bool flat) {
+	imd_file_t base;
+	reader_t d;
+	image_t img = { NULL, 0, 0 };
+
+	imd_open(&base, base_path);
+	read_file(&d, delta_path);
+	if (memcmp(take(&d, strlen(DELTA_MAGIC)), DELTA_MAGIC,
+			strlen(DELTA_MAGIC)) != 0) {
+		die("%s: not an IMD delta", delta_path);
+	}
+	if (get_u64(&d) != hash64(base.buf, base.len, 0)) {
+		die("%s: delta was not made against %s", delta_path, base_path);
+	}
+	base_track_t **idx = index_base(&base);
+	uint32_t n = get_u32(&d);
+	append(&img, take(&d, n), n);
+
+	while (true) {
+		int op = *take(&d, 1);
+		if (op == 'E') break;
+		if (op == 'T') {
+			n = get_u32(&d);
+			append(&img, take(&d, n), n);
+			continue;
+		}
+		if (op != 'K' && op != 'P') {
+			die("%s: bad delta entry", delta_path);
+		}
+		const uint8_t *ch = take(&d, 2);
+		base_track_t *b = idx[ch[0] * 16 + (ch[1] & 0x0f)];
+		if (b == NULL) {
+			die("%s: cyl %d head %d not in base", delta_path,
+				ch[0], ch[1]);
+		}
+		const imd_track_t *bt = &b->track;
+		if (op == 'K') {
+			append(&img, bt->start, bt->len);
+			continue;
+		}
+		int count = *take(&d, 1);
+		append(&img, bt->start, layout_len(bt));
+		int next = -1;
+		for (int i = 0; i < bt->num_sectors; ++i) {
+			if (next < i && count > 0) {
+				next = *take(&d, 1);
+				--count;
+			}
+			if (next == i) {
+				n = get_u32(&d);
+				append(&img, take(&d, n), n);
+			} else {
+				append(&img, bt->rec[i], rec_len(bt, i));
+			}
+		}
+		if (count > 0) {
+			die("%s: bad delta entry", delta_path);
+		}
+	}
+	free_index(idx);
+	imd_close(&base);
+	free(d.buf);
+
+	FILE *out = fopen(out_path, "wb");
+	if (out == NULL) {
+		die_errno("cannot open %s", out_path);
+	}
+	if (flat) {
+		imd_file_t res;
+		imd_open_mem(&res, out_path, img.buf, img.len);
+		imd_write_flat(&res, out);
+	} else {
+		fwrite(img.buf, 1, img.len, out);
+	}
+	if (fclose(out) != 0) {
+		die_errno("cannot write %s", out_path);
+	}
+	free(img.buf);
+}
@@ -0,0 +1,15 @@
+/*
+	delta.h: IMD images stored as a delta against a base IMD
+*/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+
+void delta_imd(const char *base_path, const char *imd_path,
+		const char *out_path, bool verbose);
+void undelta_imd(const char *base_path, const char *delta_path,
+		const char *out_path, bool flat);
+
+#endif
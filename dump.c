@@ -0,0 +1,136 @@
+/*
+	dump.c: fast text dump of a disk, see dump.h
+
+	Track summary line:
+		"%2d.%d:" cyl head, then " unknown" or
+		" MODE NxSIZE" and per sector " " followed by "-" (missing)
+		or ["?"]NUM["d"]["[C.H]"] (bad, deleted, logical cyl/head
+		if they differ from the physical ones)
+	Sector data, 16 bytes per line:
+		"  %04x:" offset, " %02x" per byte, two spaces, the bytes
+		as ASCII ('.' if not printable)
+*/
+
+#include "dump.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DUMP_BUF	(1 << 16)
+#define LINE_LEN	(7 + 16 * 3 + 2 + 16 + 1)
+
+static char hex3[256][3];	// " %02x"
+static char ascii[256];
+static const char digits[] = "0123456789abcdef";
+
+typedef struct {
+	FILE *out;
+	char buf[DUMP_BUF];
+	size_t n;
+} dump_t;
+
+static void init_tables(void) {
+	static bool done;
+	if (done) return;
+	for (int i = 0; i < 256; ++i) {
+		hex3[i][0] = ' ';
+		hex3[i][1] = digits[i >> 4];
+		hex3[i][2] = digits[i & 15];
+		ascii[i] = (i >= 32 && i < 127) ? i : '.';
+	}
+	done = true;
+}
+
+static void flush(dump_t *d) {
+	fwrite(d->buf, 1, d->n, d->out);
+	d->n = 0;
+}
+
+static char *room(dump_t *d, size_t len) {
+	if (d->n + len > sizeof(d->buf)) flush(d);
+	return d->buf + d->n;
+}
+
+static void put_sector(dump_t *d, const uint8_t *data, int size) {
+	for (int i = 0; i < size; i += 16) {
+		char *p = room(d, LINE_LEN);
+		memcpy(p, "  ", 2);
+		p[2] = digits[(i >> 12) & 15];
+		p[3] = digits[(i >> 8) & 15];
+		p[4] = digits[(i >> 4) & 15];
+		p[5] = digits[i & 15];
+		p[6] = ':';
+		p += 7;
+		for (int j = 0; j < 16; ++j) {
+			memcpy(p, hex3[data[i + j]], 3);
+			p += 3;
+		}
+		*p++ = ' ';
+		*p++ = ' ';
+		for (int j = 0; j < 16; ++j) {
+			*p++ = ascii[data[i + j]];
+		}
+		*p = '\n';
+		d->n += LINE_LEN;
+	}
+}
+
+// short printf-formatted pieces of the summary lines
+static void put(dump_t *d, const char *fmt, int a, int b) {
+	char *p = room(d, 64);
+	d->n += snprintf(p, 64, fmt, a, b);
+}
+
+static void put_track(dump_t *d, const track_t *t, int cyl, int head,
+			bool with_data) {
+	put(d, "%2d.%d:", cyl, head);
+	if (t->status == TRACK_UNKNOWN) {
+		put(d, " unknown\n", 0, 0);
+		return;
+	}
+	int size = sector_bytes(t->sector_size_code);
+	char *p = room(d, 64);
+	d->n += snprintf(p, 64, " %s %dx%d", t->data_mode->name,
+			t->num_sectors, size);
+	for (int s = 0; s < t->num_sectors; ++s) {
+		const sector_t *sec = &t->sectors[s];
+		if (sec->status == SECTOR_MISSING) {
+			put(d, " -", 0, 0);
+			continue;
+		}
+		put(d, sec->status == SECTOR_BAD ? " ?%d" : " %d",
+			sec->log_sector, 0);
+		if (sec->deleted) put(d, "d", 0, 0);
+		if (sec->log_cyl != t->phys_cyl ||
+				sec->log_head != t->phys_head) {
+			put(d, "[%d.%d]", sec->log_cyl, sec->log_head);
+		}
+	}
+	put(d, "\n", 0, 0);
+	if (!with_data) return;
+	for (int s = 0; s < t->num_sectors; ++s) {
+		const sector_t *sec = &t->sectors[s];
+		if (sec->status != SECTOR_MISSING) {
+			put_sector(d, sec->data, size);
+		}
+	}
+}
+
+void dump_disk(const disk_t *disk, bool with_data, FILE *out) {
+	dump_t *d = malloc(sizeof(*d));
+	if (d == NULL) {
+		die("out of memory");
+	}
+	init_tables();
+	d->out = out;
+	d->n = 0;
+	for (int cyl = 0; cyl < disk->num_phys_cyls; ++cyl) {
+		for (int head = 0; head < disk->num_phys_heads; ++head) {
+			put_track(d, &disk->tracks[cyl][head], cyl, head,
+				with_data);
+		}
+	}
+	flush(d);
+	free(d);
+}
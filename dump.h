@@ -0,0 +1,21 @@
+/*
+	dump.h: fast text dump of a disk, in show_disk()'s format
+
+	Produces the same text as dumpfloppy's show_disk(): one summary
+	line per track and, with data, a hex/ASCII dump of each sector.
+	Lines are built from lookup tables into a large buffer instead of
+	one stdio call per byte. perf/perfcheck.sh checks that the two
+	agree byte for byte; raw2imd --show-disk uses show_disk().
+*/
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+void dump_disk(const disk_t *disk, bool with_data, FILE *out);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+	fat.c: FAT12 filesystem access, see fat.h
+
+	The whole FAT is decoded into an array up front, so following a
+	cluster chain is one lookup per cluster, and runs of consecutive
+	clusters are copied from the image in one piece.
+*/
+
+#include "fat.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FAT_DIRENT	32
+#define ATTR_VOLUME	0x08
+#define ATTR_DIR	0x10
+#define ATTR_LFN	0x0f
+#define FAT12_EOC	0xff8	// end of chain, and above
+
+static inline int le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+// returns -1 if the image does not hold a plausible FAT12 filesystem
+int fat_open(fat_disk_t *d, const uint8_t *image, size_t size) {
+	memset(d, 0, sizeof(*d));
+	if (size < 512) return -1;
+	const uint8_t *b = image;
+	d->image = image;
+	d->size = size;
+	d->bps = le16(b + 11);
+	d->spc = b[13];
+	d->reserved = le16(b + 14);
+	d->nfats = b[16];
+	d->root_entries = le16(b + 17);
+	d->total = le16(b + 19);
+	d->spf = le16(b + 22);
+	if ((d->bps != 128 && d->bps != 256 && d->bps != 512 &&
+			d->bps != 1024) || d->spc == 0 ||
+			(d->spc & (d->spc - 1)) != 0 || d->reserved == 0 ||
+			d->nfats == 0 || d->nfats > 2 || d->spf == 0 ||
+			d->root_entries == 0 || d->total == 0 ||
+			b[21] < 0xf0) {
+		return -1;
+	}
+	size_t fat = (size_t)d->reserved * d->bps;
+	d->root = fat + (size_t)d->nfats * d->spf * d->bps;
+	size_t root_len = (size_t)d->root_entries * FAT_DIRENT;
+	root_len = (root_len + d->bps - 1) / d->bps * d->bps;
+	d->data = d->root + root_len;
+	size_t end = (size_t)d->total * d->bps;
+	if (end > size) end = size;
+	if (d->data >= end) return -1;
+	d->clusters = (end - d->data) / ((size_t)d->spc * d->bps) + 2;
+	if (d->clusters > 4085 + 2) return -1;	// FAT16
+	size_t need = (d->clusters * 3 + 1) / 2;
+	if (need > (size_t)d->spf * d->bps) return -1;
+
+	d->fat = malloc(d->clusters * sizeof(*d->fat));
+	if (d->fat == NULL) {
+		die("out of memory");
+	}
+	const uint8_t *f = image + fat;
+	for (int c = 0; c < d->clusters; ++c) {
+		const uint8_t *p = f + c * 3 / 2;
+		int v = p[0] | (p[1] << 8);
+		d->fat[c] = (c & 1) ? v >> 4 : v & 0xfff;
+	}
+	return 0;
+}
+
+void fat_close(fat_disk_t *d) {
+	free(d->fat);
+	d->fat = NULL;
+}
+
+static size_t cluster_off(const fat_disk_t *d, int c) {
+	return d->data + (size_t)(c - 2) * d->spc * d->bps;
+}
+
+static bool valid_cluster(const fat_disk_t *d, int c) {
+	return c >= 2 && c < d->clusters;
+}
+
+/*
+ * Calls out() for each run of consecutive clusters in the chain
+ * starting at 'c', up to 'len' bytes (SIZE_MAX: whole chain).
+ * Returns the bytes passed, stopping at bad links or loops.
+ */
+static size_t read_chain(const fat_disk_t *d, int c, size_t len,
+		void (*out)(const uint8_t *p, size_t n, void *arg), void *arg) {
+	size_t csize = (size_t)d->spc * d->bps;
+	size_t done = 0;
+	int steps = 0;
+	while (valid_cluster(d, c) && done < len && steps < d->clusters) {
+		int first = c;
+		int n = 1;
+		while (valid_cluster(d, d->fat[c]) && d->fat[c] == c + 1) {
+			c = d->fat[c];
+			++n;
+		}
+		steps += n;
+		size_t off = cluster_off(d, first);
+		size_t run = n * csize;
+		if (off >= d->size) break;
+		if (run > d->size - off) run = d->size - off;
+		if (run > len - done) run = len - done;
+		out(d->image + off, run, arg);
+		done += run;
+		c = d->fat[c];
+	}
+	return done;
+}
+
+static void to_file(const uint8_t *p, size_t n, void *arg) {
+	fwrite(p, 1, n, arg);
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+} dirbuf_t;
+
+static void to_buf(const uint8_t *p, size_t n, void *arg) {
+	dirbuf_t *b = arg;
+	b->buf = realloc(b->buf, b->len + n);
+	if (b->buf == NULL) {
+		die("out of memory");
+	}
+	memcpy(b->buf + b->len, p, n);
+	b->len += n;
+}
+
+static void entry_name(const uint8_t *e, char *name) {
+	int n = 0;
+	for (int i = 0; i < 8 && e[i] != ' '; ++i) {
+		name[n++] = (i == 0 && e[i] == 0x05) ? 0xe5 : e[i];
+	}
+	if (e[8] != ' ') {
+		name[n++] = '.';
+		for (int i = 8; i < 11 && e[i] != ' '; ++i) {
+			name[n++] = e[i];
+		}
+	}
+	name[n] = '\0';
+	for (int i = 0; i < n; ++i) {
+		if (name[i] == '/' || (uint8_t)name[i] < ' ') name[i] = '_';
+	}
+}
+
+static int walk_dir(const fat_disk_t *d, const uint8_t *ents, size_t len,
+			const char *dir, const char *path, FILE *list,
+			int depth) {
+	char name[13];
+	char sub[PATH_MAX];
+	char out[PATH_MAX];
+	int files = 0;
+
+	for (size_t i = 0; i + FAT_DIRENT <= len; i += FAT_DIRENT) {
+		const uint8_t *e = ents + i;
+		if (e[0] == 0x00) break;
+		if (e[0] == 0xe5 || e[11] == ATTR_LFN ||
+				(e[11] & ATTR_VOLUME)) {
+			continue;
+		}
+		entry_name(e, name);
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		int c = le16(e + 26);
+		uint32_t size = e[28] | (e[29] << 8) | (e[30] << 16) |
+				((uint32_t)e[31] << 24);
+		snprintf(sub, sizeof(sub), "%s/%s", path, name);
+		if (dir != NULL) {
+			snprintf(out, sizeof(out), "%s%s", dir, sub);
+		}
+		if (e[11] & ATTR_DIR) {
+			if (list != NULL) {
+				fprintf(list, "%s/\n", sub);
+			}
+			if (depth > 32) continue;	// loop guard
+			if (dir != NULL && mkdir(out, 0777) < 0 &&
+					errno != EEXIST) {
+				die_errno("cannot create %s", out);
+			}
+			dirbuf_t b = { NULL, 0 };
+			read_chain(d, c, SIZE_MAX, to_buf, &b);
+			files += walk_dir(d, b.buf, b.len, dir, sub, list,
+					depth + 1);
+			free(b.buf);
+			continue;
+		}
+		if (list != NULL) {
+			fprintf(list, "%s %u\n", sub, size);
+		}
+		if (dir != NULL) {
+			FILE *f = fopen(out, "wb");
+			if (f == NULL) {
+				die_errno("cannot open %s", out);
+			}
+			read_chain(d, c, size, to_file, f);
+			if (fclose(f) != 0) {
+				die_errno("cannot write %s", out);
+			}
+		}
+		++files;
+	}
+	return files;
+}
+
+/*
+ * Extracts all files into 'dir' (if not NULL) and lists paths and
+ * sizes on 'list' (if not NULL). Returns the number of files.
+ */
+int fat_walk(const fat_disk_t *d, const char *dir, FILE *list) {
+	if (dir != NULL && mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		die_errno("cannot create %s", dir);
+	}
+	size_t len = (size_t)d->root_entries * FAT_DIRENT;
+	if (d->root + len > d->size) {
+		len = d->size > d->root ? d->size - d->root : 0;
+	}
+	return walk_dir(d, d->image + d->root, len, dir, "", list, 0);
+}
@@ -0,0 +1,38 @@
+/*
+	fat.h: FAT12 filesystem access on flat PC disk images
+
+	The image must be in LBA order (cylinder, head, sector), which is
+	the order of an interlaced raw file or a flattened IMD.
+*/
+
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+	const uint8_t *image;
+	size_t size;
+	// from the BIOS parameter block
+	int bps;		// bytes per sector
+	int spc;		// sectors per cluster
+	int reserved;
+	int nfats;
+	int root_entries;
+	int total;		// total sectors
+	int spf;		// sectors per FAT
+	// derived
+	size_t root;		// byte offsets
+	size_t data;
+	int clusters;		// highest cluster number + 1
+	uint16_t *fat;		// decoded FAT, one entry per cluster
+} fat_disk_t;
+
+int fat_open(fat_disk_t *d, const uint8_t *image, size_t size);
+void fat_close(fat_disk_t *d);
+int fat_walk(const fat_disk_t *d, const char *dir, FILE *list);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+	fingerprint.c: MinHash signatures and LSH grouping, see fingerprint.h
+
+	Signature file format, one image per line:
+		fp1 <FP_SLOTS x 8 hex digits> <image name>
+*/
+
+#include "fingerprint.h"
+#include "hash.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FP_ROWS		(FP_SLOTS / FP_BANDS)
+
+// splitmix64 finalizer: one cheap independent hash per slot
+static inline uint64_t mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+void fp_init(fingerprint_t *fp) {
+	memset(fp->min, 0xff, sizeof(fp->min));
+}
+
+void fp_add(fingerprint_t *fp, uint64_t feature) {
+	for (int i = 0; i < FP_SLOTS; ++i) {
+		uint32_t h = mix(feature + i * 0x9e3779b97f4a7c15ULL) >> 32;
+		if (h < fp->min[i]) fp->min[i] = h;
+	}
+}
+
+void fp_write(const fingerprint_t *fp, const char *name, FILE *out) {
+	fprintf(out, "fp1 ");
+	for (int i = 0; i < FP_SLOTS; ++i) {
+		fprintf(out, "%08x", fp->min[i]);
+	}
+	fprintf(out, " %s\n", name);
+}
+
+// percent of equal slots
+int fp_similarity(const fingerprint_t *a, const fingerprint_t *b) {
+	int n = 0;
+	for (int i = 0; i < FP_SLOTS; ++i) {
+		n += (a->min[i] == b->min[i]);
+	}
+	return n * 100 / FP_SLOTS;
+}
+
+typedef struct {
+	fingerprint_t fp;
+	char *name;
+	int parent;	// union-find
+} fp_image_t;
+
+typedef struct {
+	uint64_t key;	// band hash
+	int image;
+} fp_bucket_t;
+
+static int find(fp_image_t *img, int i) {
+	while (img[i].parent != i) {
+		img[i].parent = img[img[i].parent].parent;
+		i = img[i].parent;
+	}
+	return i;
+}
+
+static void join(fp_image_t *img, int a, int b) {
+	a = find(img, a);
+	b = find(img, b);
+	if (a < b) img[b].parent = a;
+	else if (b < a) img[a].parent = b;
+}
+
+static int cmp_bucket(const void *a, const void *b) {
+	const fp_bucket_t *x = a;
+	const fp_bucket_t *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->image - y->image;
+}
+
+static int cmp_group(const void *a, const void *b) {
+	const int *x = a;
+	const int *y = b;
+	if (x[0] != y[0]) return x[0] - y[0];
+	return x[1] - y[1];
+}
+
+static bool parse_line(char *line, fp_image_t *img) {
+	char *p = line;
+	if (strncmp(p, "fp1 ", 4) != 0) return false;
+	p += 4;
+	for (int i = 0; i < FP_SLOTS; ++i) {
+		char hex[9];
+		memcpy(hex, p, 8);
+		hex[8] = '\0';
+		char *end;
+		img->fp.min[i] = strtoul(hex, &end, 16);
+		if (end != hex + 8) return false;
+		p += 8;
+	}
+	if (*p++ != ' ') return false;
+	p[strcspn(p, "\n")] = '\0';
+	img->name = strdup(p);
+	return img->name != NULL;
+}
+
+/*
+ * Groups near-duplicate images from signature files. Images sharing
+ * any LSH band are candidates; candidates at or above 'threshold'
+ * percent estimated similarity are joined. Prints one line per image
+ * in a group of two or more: group number, similarity to the group's
+ * first image, name.
+ */
+void fp_index(int nfiles, char **files, int threshold, FILE *out) {
+	fp_image_t *img = NULL;
+	int nimg = 0;
+	int max = 0;
+	char line[4096];
+
+	for (int f = 0; f < nfiles; ++f) {
+		FILE *in = fopen(files[f], "r");
+		if (in == NULL) {
+			die_errno("cannot open %s", files[f]);
+		}
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (nimg == max) {
+				max = max ? max * 2 : 1024;
+				img = realloc(img, max * sizeof(*img));
+				if (img == NULL) {
+					die("out of memory");
+				}
+			}
+			if (!parse_line(line, &img[nimg])) {
+				die("%s: bad signature line", files[f]);
+			}
+			img[nimg].parent = nimg;
+			++nimg;
+		}
+		fclose(in);
+	}
+
+	fp_bucket_t *bkt = malloc((size_t)nimg * FP_BANDS * sizeof(*bkt));
+	if (nimg > 0 && bkt == NULL) {
+		die("out of memory");
+	}
+	for (int i = 0; i < nimg; ++i) {
+		for (int b = 0; b < FP_BANDS; ++b) {
+			fp_bucket_t *e = &bkt[i * FP_BANDS + b];
+			e->key = hash64(&img[i].fp.min[b * FP_ROWS],
+				FP_ROWS * sizeof(uint32_t), b);
+			e->image = i;
+		}
+	}
+	size_t nbkt = (size_t)nimg * FP_BANDS;
+	qsort(bkt, nbkt, sizeof(*bkt), cmp_bucket);
+	// within a bucket, compare with the first and the previous member
+	// only, which keeps huge buckets (e.g. blank disks) linear
+	for (size_t i = 1, first = 0; i < nbkt; ++i) {
+		if (bkt[i].key != bkt[first].key) {
+			first = i;
+			continue;
+		}
+		int a = bkt[i].image;
+		int f = bkt[first].image;
+		int p = bkt[i - 1].image;
+		if (fp_similarity(&img[a].fp, &img[f].fp) >= threshold) {
+			join(img, a, f);
+		} else if (p != f &&
+			fp_similarity(&img[a].fp, &img[p].fp) >= threshold) {
+			join(img, a, p);
+		}
+	}
+	free(bkt);
+
+	// (root, image) pairs, sorted so groups print together
+	int *grp = malloc((size_t)nimg * 2 * sizeof(int));
+	int *size = calloc(nimg ? nimg : 1, sizeof(int));
+	if ((nimg > 0 && grp == NULL) || size == NULL) {
+		die("out of memory");
+	}
+	for (int i = 0; i < nimg; ++i) {
+		grp[i * 2] = find(img, i);
+		grp[i * 2 + 1] = i;
+		++size[grp[i * 2]];
+	}
+	qsort(grp, nimg, 2 * sizeof(int), cmp_group);
+	int ngroups = 0;
+	for (int i = 0; i < nimg; ++i) {
+		int root = grp[i * 2];
+		int n = grp[i * 2 + 1];
+		if (size[root] < 2) continue;
+		if (n == root) ++ngroups;
+		fprintf(out, "%d %d%% %s\n", ngroups,
+			fp_similarity(&img[n].fp, &img[root].fp), img[n].name);
+	}
+	for (int i = 0; i < nimg; ++i) {
+		free(img[i].name);
+	}
+	free(size);
+	free(grp);
+	free(img);
+}
@@ -0,0 +1,28 @@
+/*
+	fingerprint.h: MinHash signatures for near-duplicate disk detection
+
+	A signature summarizes the set of sector contents on a disk.
+	The fraction of equal slots in two signatures estimates the
+	Jaccard similarity of the two sets.
+*/
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FP_SLOTS	32
+#define FP_BANDS	8	// LSH bands of FP_SLOTS / FP_BANDS slots
+
+typedef struct {
+	uint32_t min[FP_SLOTS];
+} fingerprint_t;
+
+void fp_init(fingerprint_t *fp);
+void fp_add(fingerprint_t *fp, uint64_t feature);
+void fp_write(const fingerprint_t *fp, const char *name, FILE *out);
+int fp_similarity(const fingerprint_t *a, const fingerprint_t *b);
+void fp_index(int nfiles, char **files, int threshold, FILE *out);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+	hash.c: XXH64 content hash, see hash.h
+*/
+
+#include "hash.h"
+
+#define P1	11400714785074694791ULL
+#define P2	14029467366897019727ULL
+#define P3	1609587929392839161ULL
+#define P4	9650029242287828579ULL
+#define P5	2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// little-endian loads, independent of host byte order
+static inline uint64_t rd64(const uint8_t *p) {
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t rd32(const uint8_t *p) {
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t in) {
+	acc += in * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+	acc ^= round64(0, v);
+	return acc * P1 + P4;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed) {
+	const uint8_t *p = buf;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + P1 + P2;
+		uint64_t v2 = seed + P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - P1;
+		do {
+			v1 = round64(v1, rd64(p));
+			v2 = round64(v2, rd64(p + 8));
+			v3 = round64(v3, rd64(p + 16));
+			v4 = round64(v4, rd64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + P5;
+	}
+	h += len;
+	while (end - p >= 8) {
+		h ^= round64(0, rd64(p));
+		h = rotl(h, 27) * P1 + P4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= rd32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p++ * P5;
+		h = rotl(h, 11) * P1;
+	}
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,18 @@
+/*
+	hash.h: fast 64-bit content hash for raw2imd
+
+	This is XXH64 (https://github.com/Cyan4973/xxHash), which consumes
+	four independent 64-bit lanes per 32-byte stripe and runs at several
+	GB/s without any platform-specific code. Values are the same on
+	every host, so they can be stored in manifests and compared later.
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed);
+
+#endif
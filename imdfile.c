@@ -0,0 +1,175 @@
+/*
+	imdfile.c: record-level reader for IMD files, see imdfile.h
+*/
+
+#include "imdfile.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void imd_open(imd_file_t *imd, const char *name) {
+	struct stat stb;
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		die_errno("cannot open %s", name);
+	}
+	if (fstat(fd, &stb) < 0) {
+		die_errno("cannot stat %s", name);
+	}
+	imd->name = name;
+	imd->len = stb.st_size;
+	imd->buf = NULL;
+	if (imd->len > 0) {
+		imd->buf = mmap(NULL, imd->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (imd->buf == MAP_FAILED) {
+			die_errno("cannot map %s", name);
+		}
+	}
+	close(fd);
+	imd_open_mem(imd, name, imd->buf, imd->len);
+	imd->mapped = true;
+}
+
+// IMD file contents already in memory
+void imd_open_mem(imd_file_t *imd, const char *name,
+			const uint8_t *buf, size_t len) {
+	const uint8_t *eoc = NULL;
+	imd->name = name;
+	imd->buf = buf;
+	imd->len = len;
+	imd->mapped = false;
+	if (len > 0) {
+		eoc = memchr(buf, 0x1a, len);
+	}
+	if (len < 4 || memcmp(buf, "IMD ", 4) != 0 || eoc == NULL) {
+		die("%s: not an IMD file", name);
+	}
+	imd->comment_len = eoc - buf;
+	imd->pos = imd->comment_len + 1;
+}
+
+void imd_rewind(imd_file_t *imd) {
+	imd->pos = imd->comment_len + 1;
+}
+
+void imd_close(imd_file_t *imd) {
+	if (imd->mapped && imd->buf != NULL) {
+		munmap((void *)imd->buf, imd->len);
+	}
+	imd->buf = NULL;
+}
+
+bool imd_sector_has_data(int type) {
+	return type != IMD_SEC_MISSING;
+}
+
+bool imd_sector_compressed(int type) {
+	return type != IMD_SEC_MISSING && (type & 1) == 0;
+}
+
+bool imd_sector_deleted(int type) {
+	return type == IMD_SEC_DELETED || type == IMD_SEC_DEL_COMPRESSED ||
+		type == IMD_SEC_DEL_ERROR || type == IMD_SEC_DEL_ERR_COMPRESSED;
+}
+
+static size_t sector_rec_len(int type, int size) {
+	if (type == IMD_SEC_MISSING) return 1;
+	return imd_sector_compressed(type) ? 2 : 1 + size;
+}
+
+/*
+ * Parses the next track record. Returns false at end of file,
+ * dies on a truncated or malformed record.
+ */
+bool imd_next_track(imd_file_t *imd, imd_track_t *track) {
+	const uint8_t *p = imd->buf + imd->pos;
+	const uint8_t *end = imd->buf + imd->len;
+	if (p >= end) return false;
+	if (end - p < 5) goto bad;
+	track->start = p;
+	track->mode = p[0];
+	track->cyl = p[1];
+	track->head = p[2] & 0x0f;
+	track->flags = p[2] & (IMD_HEAD_CMAP | IMD_HEAD_HMAP);
+	track->num_sectors = p[3];
+	track->size_code = p[4];
+	if (track->size_code > 6) goto bad;
+	track->sector_size = 128 << track->size_code;
+	p += 5;
+	int n = track->num_sectors;
+	size_t maps = n * (1 + !!(track->flags & IMD_HEAD_CMAP) +
+				!!(track->flags & IMD_HEAD_HMAP));
+	if (end - p < maps) goto bad;
+	track->smap = p;
+	p += n;
+	track->cmap = NULL;
+	track->hmap = NULL;
+	if (track->flags & IMD_HEAD_CMAP) {
+		track->cmap = p;
+		p += n;
+	}
+	if (track->flags & IMD_HEAD_HMAP) {
+		track->hmap = p;
+		p += n;
+	}
+	for (int i = 0; i < n; ++i) {
+		if (p >= end || *p > IMD_SEC_DEL_ERR_COMPRESSED) goto bad;
+		size_t l = sector_rec_len(*p, track->sector_size);
+		if (end - p < l) goto bad;
+		track->rec[i] = p;
+		p += l;
+	}
+	track->len = p - track->start;
+	imd->pos = p - imd->buf;
+	return true;
+bad:
+	die("%s: malformed track record at offset %zu", imd->name, imd->pos);
+	return false;
+}
+
+/*
+ * Expands sector record 'i' into 'out' (sector_size bytes).
+ * Missing sectors read as zeros.
+ */
+void imd_sector_data(const imd_track_t *track, int i, uint8_t *out) {
+	const uint8_t *r = track->rec[i];
+	if (*r == IMD_SEC_MISSING) {
+		memset(out, 0, track->sector_size);
+	} else if (imd_sector_compressed(*r)) {
+		memset(out, r[1], track->sector_size);
+	} else {
+		memcpy(out, r + 1, track->sector_size);
+	}
+}
+
+/*
+ * Writes the sector data as a flat image: tracks in file order,
+ * sectors of each track in ascending logical sector number.
+ */
+void imd_write_flat(imd_file_t *imd, FILE *out) {
+	imd_track_t trk;
+	uint8_t buf[128 << 6];
+
+	imd_rewind(imd);
+	while (imd_next_track(imd, &trk)) {
+		int order[256];
+		int n = trk.num_sectors;
+		for (int i = 0; i < n; ++i) {
+			int j = i;
+			// insertion sort by logical sector
+			while (j > 0 && trk.smap[order[j - 1]] > trk.smap[i]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+		for (int i = 0; i < n; ++i) {
+			imd_sector_data(&trk, order[i], buf);
+			fwrite(buf, 1, trk.sector_size, out);
+		}
+	}
+}
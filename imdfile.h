@@ -0,0 +1,70 @@
+/*
+	imdfile.h: record-level reader for IMD files
+
+	Unlike dumpfloppy's IMD loader, this keeps every track and sector
+	record exactly as stored, so callers can re-derive flat sector
+	data or pass records through untouched. The file is mapped, and
+	records point directly into the mapping.
+*/
+
+#ifndef IMDFILE_H
+#define IMDFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// IMD sector record types
+#define IMD_SEC_MISSING		0
+#define IMD_SEC_NORMAL		1
+#define IMD_SEC_COMPRESSED	2
+#define IMD_SEC_DELETED		3
+#define IMD_SEC_DEL_COMPRESSED	4
+#define IMD_SEC_ERROR		5
+#define IMD_SEC_ERR_COMPRESSED	6
+#define IMD_SEC_DEL_ERROR	7
+#define IMD_SEC_DEL_ERR_COMPRESSED 8
+
+#define IMD_HEAD_CMAP	0x80	// head byte flag: cylinder map present
+#define IMD_HEAD_HMAP	0x40	// head byte flag: head map present
+
+typedef struct {
+	const uint8_t *start;	// whole track record
+	size_t len;
+	int mode;
+	int cyl;
+	int head;		// physical head, flags removed
+	int flags;		// IMD_HEAD_CMAP, IMD_HEAD_HMAP
+	int num_sectors;
+	int size_code;
+	int sector_size;
+	const uint8_t *smap;	// logical sector numbers
+	const uint8_t *cmap;	// NULL: same as cyl
+	const uint8_t *hmap;	// NULL: same as head
+	const uint8_t *rec[256]; // sector records (type byte first)
+} imd_track_t;
+
+typedef struct {
+	const char *name;
+	const uint8_t *buf;	// mapped file
+	size_t len;
+	size_t comment_len;	// comment is buf[0..comment_len)
+	size_t pos;		// next track record
+	bool mapped;
+} imd_file_t;
+
+void imd_open(imd_file_t *imd, const char *name);
+void imd_open_mem(imd_file_t *imd, const char *name,
+			const uint8_t *buf, size_t len);
+bool imd_next_track(imd_file_t *imd, imd_track_t *track);
+void imd_rewind(imd_file_t *imd);
+void imd_close(imd_file_t *imd);
+
+bool imd_sector_has_data(int type);
+bool imd_sector_compressed(int type);
+bool imd_sector_deleted(int type);
+void imd_sector_data(const imd_track_t *track, int i, uint8_t *out);
+void imd_write_flat(imd_file_t *imd, FILE *out);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+	jobs.c: fork-based job runner, see jobs.h
+
+	Each item is processed in its own child process, at most 'jobs'
+	at a time. A child that fails (including via die()) only fails its
+	own item. Children inherit the parent's state, so per-file changes
+	to global options do not leak between items.
+*/
+
+#include "jobs.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int default_jobs(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Anonymous memory that stays shared with children forked after this,
+ * for results a job function hands back to the parent.
+ */
+void *shared_alloc(size_t len) {
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		die_errno("mmap");
+	}
+	return p;
+}
+
+/*
+ * Calls fn(i, arg) for 0 <= i < n, and then done(i, ok, arg) in the
+ * parent as each call finishes (if 'done' is not NULL). Returns the
+ * number of calls that returned non-zero or whose child did not exit
+ * normally.
+ */
+int run_indexed_done(int n, int jobs, int (*fn)(int i, void *arg),
+		void (*done)(int i, bool ok, void *arg), void *arg) {
+	int failed = 0;
+	int running = 0;
+	int next = 0;
+
+	if (jobs < 1) jobs = 1;
+	pid_t *pids = calloc(jobs, sizeof(*pids));
+	int *items = calloc(jobs, sizeof(*items));
+	if (pids == NULL || items == NULL) {
+		die("out of memory");
+	}
+	fflush(stdout);
+	fflush(stderr);
+	while (next < n || running > 0) {
+		if (next < n && running < jobs) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				die_errno("fork");
+			}
+			if (pid == 0) {
+				// buffered, so each item's output goes out in
+				// as few writes as possible
+				static char buf[1 << 16];
+				setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+				exit(fn(next, arg) ? 1 : 0);
+			}
+			int slot = 0;
+			while (pids[slot] != 0) ++slot;
+			pids[slot] = pid;
+			items[slot] = next;
+			++running;
+			++next;
+			continue;
+		}
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			die_errno("wait");
+		}
+		int slot = 0;
+		while (slot < jobs && pids[slot] != pid) ++slot;
+		if (slot == jobs) continue;	// not one of ours
+		pids[slot] = 0;
+		--running;
+		bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if (!ok) {
+			++failed;
+		}
+		if (done != NULL) {
+			done(items[slot], ok, arg);
+		}
+	}
+	free(items);
+	free(pids);
+	return failed;
+}
+
+int run_indexed(int n, int jobs, int (*fn)(int i, void *arg), void *arg) {
+	return run_indexed_done(n, jobs, fn, NULL, arg);
+}
+
+typedef struct {
+	char **items;
+	int (*fn)(const char *item);
+} item_job_t;
+
+static int run_item(int i, void *arg) {
+	item_job_t *j = arg;
+	return j->fn(j->items[i]);
+}
+
+/*
+ * Returns the number of items whose function returned non-zero
+ * or whose child did not exit normally.
+ */
+int run_jobs(int n, char **items, int jobs, int (*fn)(const char *item)) {
+	item_job_t j = { items, fn };
+	return run_indexed(n, jobs, run_item, &j);
+}
@@ -0,0 +1,18 @@
+/*
+	jobs.h: run a per-file function over many files in parallel
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int default_jobs(void);
+int run_jobs(int n, char **items, int jobs, int (*fn)(const char *item));
+int run_indexed(int n, int jobs, int (*fn)(int i, void *arg), void *arg);
+int run_indexed_done(int n, int jobs, int (*fn)(int i, void *arg),
+		void (*done)(int i, bool ok, void *arg), void *arg);
+void *shared_alloc(size_t len);
+
+#endif
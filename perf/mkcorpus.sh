@@ -0,0 +1,69 @@
+#!/bin/sh
+# Generate the synthetic benchmark corpus listed in corpus.txt.
+# Images are deterministic, so IMD output can be compared against
+# golden files. Usage: mkcorpus.sh [DIR]
+set -e
+dir=${1:-perf/corpus}
+mkdir -p "$dir"
+export LC_ALL=C
+
+# fill BYTES VALUE - uniform bytes (blank/formatted media)
+fill() {
+	head -c "$1" /dev/zero | tr '\000' "$2"
+}
+
+# text BYTES - directory-like and text content
+text() {
+	seq 1 1000000 | sed 's/^/LINE /' | head -c "$1"
+}
+
+# noise BYTES SEED - incompressible pseudo-random content
+noise() {
+	awk -v n="$1" -v seed="$2" 'BEGIN {
+		x = seed
+		for (i = 0; i < n; i++) {
+			x = (x * 1103515245 + 12345) % 2147483648
+			printf "%c", int(x / 65536) % 256
+		}
+	}'
+}
+
+# trailer GEOM - 128-byte logdisk geometry trailer
+trailer() {
+	printf '%s\n' "$1"
+	head -c $((128 - ${#1} - 1)) /dev/zero
+}
+
+{	# 40 x 2 x 10 x 512
+	text 20480
+	fill 60000 '\345'
+	noise 100000 1
+	fill 229120 '\345'
+	trailer 5m512z10p2s40t1d2i3l0h
+} > "$dir/kaypro-dsdd.logdisk"
+
+{	# 40 x 1 x 16 x 256
+	noise 40960 2
+	text 61440
+	fill 61440 '\345'
+	trailer 5m256z16p1s40t1d1i3l0h
+} > "$dir/h89-ssdd.logdisk"
+
+{	# 77 x 1 x 26 x 128
+	fill 6656 '\000'
+	text 100000
+	fill 149600 '\345'
+} > "$dir/cpm-8ssd.raw"
+
+{	# 80 x 2 x 18 x 512
+	noise 16384 3
+	fill 16384 '\366'
+	text 400000
+	noise 300000 4
+	fill 741792 '\000'
+} > "$dir/pc-1440k.raw"
+
+{	# 40 x 2 x 9 x 512
+	text 184320
+	noise 184320 5
+} > "$dir/wrap-dsdd.raw"
@@ -0,0 +1,116 @@
+#!/bin/sh
+# Correctness and throughput gate for raw2imd.
+#
+# Converts every image in the benchmark corpus, compares the IMD output
+# byte-for-byte against perf/golden/ (ignoring the first comment line,
+# which holds the creation date) and compares aggregate throughput with
+# perf/baseline.HOST, which is recorded on the first run on each host.
+# It also checks that --batch with a --cyl window past the end of the
+# disk matches single-file conversion, and that the -vv dump matches
+# the one from show_disk() and perf/golden/NAME.vv.
+# Fails if any output differs or throughput drops more than
+# PERF_TOLERANCE percent (default 10).
+#
+# Usage: perfcheck.sh RAW2IMD [--baseline]
+#   --baseline  record golden files (IMD and show_disk() -vv output) and
+#               throughput from RAW2IMD; the golden files note the
+#               dumpfloppy commit they came from
+set -e
+bin=$1
+mode=$2
+here=$(dirname "$0")
+dir=${PERF_CORPUS:-$here/corpus}
+golden=$here/golden
+baseline=$here/baseline.$(uname -n)
+passes=${PERF_PASSES:-20}
+tolerance=${PERF_TOLERANCE:-10}
+
+[ -d "$dir" ] || sh "$here/mkcorpus.sh" "$dir"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+if [ "$mode" = --baseline ]; then
+	mkdir -p "$golden"
+	sub=$here/../dumpfloppy
+	if [ -e "$sub/.git" ]; then
+		git -C "$sub" rev-parse HEAD > "$golden/dumpfloppy.rev"
+	else
+		echo unknown > "$golden/dumpfloppy.rev"
+	fi
+fi
+
+fail=0
+grep -v '^#' "$here/corpus.txt" > "$out/list"
+while read -r name opts; do
+	$bin $opts "$dir/$name" "$out/$name.imd"
+	tail -n +2 "$out/$name.imd" > "$out/$name.body"
+	if [ "$mode" = --baseline ]; then
+		cp "$out/$name.body" "$golden/$name.imd"
+	elif [ ! -f "$golden/$name.imd" ]; then
+		echo "perfcheck: $name: no golden file, output not checked" >&2
+	elif ! cmp -s "$out/$name.body" "$golden/$name.imd"; then
+		echo "perfcheck: $name: IMD output differs from golden" >&2
+		fail=1
+	fi
+	# --batch with a --cyl window past the last cylinder must write
+	# the same IMD as a single-file conversion
+	$bin $opts --cyl 1-999 "$dir/$name" "$out/$name.win"
+	$bin $opts --cyl 1-999 --batch "$out/batch" "$dir/$name" ||
+		echo "perfcheck: $name: --batch failed" >&2
+	tail -n +2 "$out/$name.win" > "$out/$name.win.body"
+	tail -n +2 "$out/batch/$name.imd" > "$out/$name.batch.body" \
+		2>/dev/null || true
+	if ! cmp -s "$out/$name.win.body" "$out/$name.batch.body"; then
+		echo "perfcheck: $name: --batch --cyl output differs" >&2
+		fail=1
+	fi
+	# -vv dump: the fast formatter must match show_disk() exactly
+	$bin -vv $opts "$dir/$name" "$out/$name.imd" > "$out/$name.dump"
+	$bin -vv --show-disk $opts "$dir/$name" "$out/$name.imd" \
+		> "$out/$name.show"
+	if ! cmp -s "$out/$name.dump" "$out/$name.show"; then
+		echo "perfcheck: $name: -vv output differs from show_disk()" >&2
+		fail=1
+	fi
+	if [ "$mode" = --baseline ]; then
+		cp "$out/$name.show" "$golden/$name.vv"
+	elif [ -f "$golden/$name.vv" ] &&
+			! cmp -s "$out/$name.dump" "$golden/$name.vv"; then
+		echo "perfcheck: $name: -vv output differs from golden" >&2
+		fail=1
+	fi
+done < "$out/list"
+
+bytes=0
+start=$(date +%s%N)
+p=0
+while [ $p -lt $passes ]; do
+	while read -r name opts; do
+		$bin $opts "$dir/$name" "$out/$name.imd"
+		bytes=$((bytes + $(wc -c < "$dir/$name")))
+	done < "$out/list"
+	p=$((p + 1))
+done
+end=$(date +%s%N)
+# KB per second, integer
+rate=$((bytes * 1000000 / ((end - start) / 1000 + 1)))
+rate=$((rate / 1024))
+
+if [ "$mode" = --baseline ]; then
+	echo "$rate" > "$baseline"
+	echo "perfcheck: baseline $rate KB/s"
+	exit 0
+fi
+if [ ! -f "$baseline" ]; then
+	echo "$rate" > "$baseline"
+	echo "perfcheck: $rate KB/s; recorded as $baseline, not checked"
+	exit $fail
+fi
+base=$(cat "$baseline")
+min=$((base * (100 - tolerance) / 100))
+echo "perfcheck: $rate KB/s (baseline $base KB/s, minimum $min KB/s)"
+if [ "$rate" -lt "$min" ]; then
+	echo "perfcheck: throughput regression" >&2
+	fail=1
+fi
+exit $fail
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Run a raw2imd binary over the benchmark corpus, e.g. to collect
+# a PGO profile. Usage: train.sh RAW2IMD [CORPUS-DIR] [PASSES]
+set -e
+bin=$1
+dir=${2:-perf/corpus}
+passes=${3:-5}
+here=$(dirname "$0")
+[ -d "$dir" ] || sh "$here/mkcorpus.sh" "$dir"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+grep -v '^#' "$here/corpus.txt" | while read -r name opts; do
+	p=0
+	while [ $p -lt $passes ]; do
+		$bin $opts "$dir/$name" "$out/$name.imd"
+		p=$((p + 1))
+	done
+	$bin -vv $opts "$dir/$name" > /dev/null
+done
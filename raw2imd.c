@@ -37,14 +37,29 @@
  *	80 tracks (cylinders)
  *	1 density (DD)
  *	0 interlace (side 1 placement)
- *	1 logical skew (not relevant)
+ *	1 logical skew (CP/M sector translation, 0/1: none)
  *	0 hard sectors (i.e. soft sectored)
  */
 
+#define _GNU_SOURCE	// memmem()
+
 #include "disk.h"
 #include "imd.h"
 #include "util.h"
 #include "show.h"
+#include "hash.h"
+#include "imdfile.h"
+#include "store.h"
+#include "fingerprint.h"
+#include "delta.h"
+#include "archive.h"
+#include "trigram.h"
+#include "jobs.h"
+#include "cpm.h"
+#include "fat.h"
+#include "report.h"
+#include "cache.h"
+#include "dump.h"
 
 /* derived from disk.c */
 #define MFM_250K	0	// 5.25" DD
@@ -56,15 +71,25 @@
 #define MFM_1000K	6	// 3.5" ED
 
 #include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -85,6 +110,11 @@ static struct args {
 	int mfm;
 	int dmode;	// data mode, for DATA_MODES[]
 	int policy;	// 2-side policy
+	int skew;	// physical skew, -k
+	int skew2;	// side 2, -K
+	int data_rate;	// -r
+	int lskew;	// logical (CP/M) skew, from logdisk 'l' or --lskew
+	bool lskew_set;	// --lskew given: the logdisk 'l' is ignored
 	int *sectbl;	// physical skew table
 	int *sectbl2;	// side 2
 	int offset1;	// first sector number/offset
@@ -92,15 +122,76 @@ static struct args {
 	int force;
 	int ignore;
 	bool read_comment;
+	char *comment;		// -C text, once read from stdin
+	size_t comment_len;
 	const char *title;
 	const char *imd_filename;
 	const char *image_filename;
 	int logdisk;
 	int verbose;
+	bool verify;
+	bool show_disk;		// -v output via dumpfloppy's show_disk()
+	const char *manifest;	// hash manifest output (JSON lines)
+	const char *report;	// disk report on stdout: "json" or "cbor"
+	const char *store;	// content-addressed store directory
+	const char *fingerprint; // MinHash signature output (appended)
+	const char *delta;	// base IMD: IMAGE-FILE is a delta against it
+	const char *archive;	// multi-image archive to add the IMD to
+	const char *trigrams;	// trigram index output
+	int jobs;		// parallel jobs for multi-file modes
+	const char *cpm_dir;	// CP/M file extraction directory
+	int dpb_bls;		// CP/M block size, 0: guess
+	int dpb_dirents;	// CP/M directory entries, 0: guess
+	int dpb_off;		// CP/M reserved tracks, -1: guess
+	const char *fat_dir;	// FAT file extraction directory
+	bool fat_list;		// list FAT directories
+	bool guess_skew;	// score CP/M logical skews for each file
+	int nfiles;		// files in a multi-file mode
+	const char *reraw;	// raw output in another layout
+	int out_policy;		// its 2-side policy, -1: same as -p
+	int out_order;		// its sector order within tracks
+	int in_order;		// RAW-FILE's sector order (ORDER_*)
+	int cyl_lo;		// --cyl window
+	int cyl_hi;		// -1: to the last cylinder
+	int head;		// --head, -1: all
+	bool preview;		// one-line summary per file
+	bool dry_run;		// predict IMD sizes only
+	bool reskew;		// rewrite IMD files with new skew/numbering
+	size_t budget;		// --preview bytes to read per file
+	const char *batch;	// output directory for batch conversion
+	bool cache_hash;	// batch cache also records content hashes
+	bool resume;	// batch skips work listed in the journal
+	int durability;		// DURABLE_*
+	const char *files_from;	// batch inputs listed in a file
+	int shard;		// --shard I/N: convert part I (from 1)...
+	int shards;		// ...of N, 0: everything
 } args;
 
+enum {
+	DURABLE_NONE,	// leave writeback to the kernel
+	DURABLE_BATCH,	// --batch: one syncfs() per journal group
+	DURABLE_EACH,	// fsync() each output before renaming it
+};
+
 static int dev_fd;
 
+// last cylinder of the --cyl window on a disk of 'cylinders'
+static int last_cyl(int cylinders) {
+	if (args.cyl_hi < 0 || args.cyl_hi >= cylinders) {
+		return cylinders - 1;
+	}
+	return args.cyl_hi;
+}
+
+// track within the --cyl/--head window, and within the geometry
+static bool selected(int cyl, int hd) {
+	return cyl >= args.cyl_lo && cyl <= last_cyl(args.cylinders) &&
+		(args.head < 0 || hd == args.head);
+}
+
+// per-track content hashes, sectors in raw-file order
+static uint64_t track_hash[MAX_CYLS][MAX_HEADS];
+
 static int snoop_media(const char *file) {
 	int e;
 	char buf[128];
@@ -143,7 +234,9 @@ static int snoop_media(const char *file) {
 			args.policy = p;
 			break;
 		case 'l':
-			// args.skew = p; // logical skew - not used
+			if (!args.lskew_set) {
+				args.lskew = p;
+			}
 			break;
 		case 'h':
 			// ignore hard-sectoring?
@@ -168,6 +261,231 @@ out:
 	return e;
 }
 
+/*
+ * Returns the sector that appears at position 's' in the raw
+ * image file, i.e. applies the physical skew table.
+ */
+static sector_t *raw_sector(track_t *track, int hd, int s) {
+	int sn = s;	// assume no skew (1:1)
+	if (hd > 0 && args.sectbl2 != NULL) {
+		sn = args.sectbl2[s];
+	} else if (args.sectbl != NULL) {
+		sn = args.sectbl[s];
+	}
+	return &track->sectors[sn];
+}
+
+/*
+ * Offset of a track in a raw image file with 2-side policy 'policy'.
+ */
+static off_t policy_offset(int policy, int cyl, int hd) {
+	off_t t;
+	if (policy == 0) {	// side 0 first, then side 1
+		t = hd * args.cylinders + cyl;
+	} else {		// interlaced
+		t = cyl * args.heads + hd;
+	}
+	return t * args.sectors * args.length;
+}
+
+/*
+ * Offset of a track in the raw image file, per the 2-side policy.
+ */
+static off_t track_offset(int cyl, int hd) {
+	return policy_offset(args.policy, cyl, hd);
+}
+
+/*
+ * Hash of a track's sector data in raw-file order,
+ * i.e. the hash of the track's bytes in RAW-FILE.
+ */
+static uint64_t hash_track(track_t *track, int hd, uint8_t *buf) {
+	int s;
+	for (s = 0; s < args.sectors; ++s) {
+		memcpy(buf + s * args.length, raw_sector(track, hd, s)->data,
+			args.length);
+	}
+	return hash64(buf, args.sectors * args.length, 0);
+}
+
+static bool uniform(const uint8_t *buf, int len) {
+	return buf[0] == buf[len - 1] && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/*
+ * Fingerprint features are the hashes of a track's non-uniform
+ * sectors; blank/formatted sectors would make every disk look alike.
+ */
+static void fingerprint_track(track_t *track, int hd, fingerprint_t *fp) {
+	for (int s = 0; s < args.sectors; ++s) {
+		const uint8_t *data = raw_sector(track, hd, s)->data;
+		if (!uniform(data, args.length)) {
+			fp_add(fp, hash64(data, args.length, 0));
+		}
+	}
+}
+
+static uint64_t image_hash(void) {
+	return hash64(track_hash, sizeof(track_hash[0]) * args.cylinders, 0);
+}
+
+/*
+ * Hash manifest, one JSON object per line: an image header, one line
+ * per track with the track hash and per-sector hashes (raw-file order,
+ * i.e. logical sectors first_sector, first_sector+1, ...), and a final
+ * whole-image hash.
+ */
+static void manifest_header(FILE *out) {
+	fprintf(out, "{\"image\":");
+	json_string(out, args.image_filename, strlen(args.image_filename));
+	fprintf(out, ",\"cylinders\":%d,\"heads\":%d,\"sectors\":%d,"
+		"\"length\":%d,\"hash\":\"xxh64\"}\n",
+		args.cylinders, args.heads, args.sectors, args.length);
+}
+
+static void manifest_track(track_t *track, int cyl, int hd, FILE *out) {
+	fprintf(out, "{\"cyl\":%d,\"head\":%d,\"track_hash\":"
+		"\"%016" PRIx64 "\",\"first_sector\":%d,\"sector_hashes\":[",
+		cyl, hd, track_hash[cyl][hd],
+		hd ? args.offset2 : args.offset1);
+	for (int s = 0; s < args.sectors; ++s) {
+		uint64_t h = hash64(raw_sector(track, hd, s)->data,
+					args.length, 0);
+		fprintf(out, "%s\"%016" PRIx64 "\"", s ? "," : "", h);
+	}
+	fprintf(out, "]}\n");
+}
+
+static void manifest_trailer(FILE *out) {
+	fprintf(out, "{\"image_hash\":\"%016" PRIx64 "\"}\n", image_hash());
+}
+
+/*
+ * --report: one record for the disk, one per track as it is read and
+ * one with the image hash. Sectors are listed in physical (IMD) order.
+ */
+static void report_header(report_t *r, const disk_t *disk) {
+	rp_begin_map(r);
+	rp_key(r, "type");
+	rp_string(r, "disk", 4);
+	rp_key(r, "image");
+	rp_string(r, args.image_filename, strlen(args.image_filename));
+	rp_key(r, "cylinders");
+	rp_int(r, args.cylinders);
+	rp_key(r, "heads");
+	rp_int(r, args.heads);
+	rp_key(r, "sectors");
+	rp_int(r, args.sectors);
+	rp_key(r, "length");
+	rp_int(r, args.length);
+	rp_key(r, "policy");
+	rp_int(r, args.policy);
+	rp_key(r, "comment");
+	rp_string(r, disk->comment, disk->comment_len);
+	rp_end(r);
+}
+
+static const char *sector_status(const sector_t *sec) {
+	switch (sec->status) {
+	case SECTOR_GOOD: return "good";
+	case SECTOR_BAD: return "bad";
+	default: return "missing";
+	}
+}
+
+static void report_track(report_t *r, const track_t *track) {
+	rp_begin_map(r);
+	rp_key(r, "type");
+	rp_string(r, "track", 5);
+	rp_key(r, "cyl");
+	rp_int(r, track->phys_cyl);
+	rp_key(r, "head");
+	rp_int(r, track->phys_head);
+	rp_key(r, "mode");
+	rp_string(r, track->data_mode->name, strlen(track->data_mode->name));
+	rp_key(r, "size");
+	rp_int(r, args.length);
+	rp_key(r, "hash");
+	rp_hash(r, track_hash[track->phys_cyl][track->phys_head]);
+	rp_key(r, "sectors");
+	rp_begin_array(r);
+	for (int i = 0; i < track->num_sectors; ++i) {
+		const sector_t *sec = &track->sectors[i];
+		rp_begin_map(r);
+		rp_key(r, "cyl");
+		rp_int(r, sec->log_cyl);
+		rp_key(r, "head");
+		rp_int(r, sec->log_head);
+		rp_key(r, "sector");
+		rp_int(r, sec->log_sector);
+		rp_key(r, "status");
+		rp_string(r, sector_status(sec), strlen(sector_status(sec)));
+		rp_key(r, "deleted");
+		rp_bool(r, sec->deleted);
+		if (sec->data != NULL) {
+			// the IMD writer stores uniform sectors compressed
+			rp_key(r, "compressed");
+			rp_bool(r, uniform(sec->data, args.length));
+			rp_key(r, "hash");
+			rp_hash(r, hash64(sec->data, args.length, 0));
+		}
+		rp_end(r);
+	}
+	rp_end(r);
+	rp_end(r);
+}
+
+static void report_trailer(report_t *r) {
+	rp_begin_map(r);
+	rp_key(r, "type");
+	rp_string(r, "end", 3);
+	rp_key(r, "image_hash");
+	rp_hash(r, image_hash());
+	rp_end(r);
+}
+
+/*
+ * Name of the converted image in stores and archives:
+ * IMAGE-FILE's base name, or RAW-FILE's with ".imd" appended.
+ */
+static void image_name(const char *out_name, char *name, size_t len) {
+	char path[PATH_MAX];
+	if (out_name == NULL) {
+		snprintf(path, sizeof(path), "%s", args.image_filename);
+		snprintf(name, len, "%s.imd", basename(path));
+	} else {
+		snprintf(path, sizeof(path), "%s", out_name);
+		snprintf(name, len, "%s", basename(path));
+	}
+}
+
+static void catalog_entry(const disk_t *disk, const char *name,
+				cat_entry_t *e) {
+	if (strlen(name) >= sizeof(e->name)) {
+		die("%s: name too long for the catalog", name);
+	}
+	memset(e, 0, sizeof(*e));
+	strcpy(e->name, name);
+	// title: first comment line after the "IMD x.y: date" line
+	const char *t = memchr(disk->comment, '\n', disk->comment_len);
+	if (t != NULL) {
+		++t;
+		size_t n = disk->comment + disk->comment_len - t;
+		n = strcspn(t, "\r\n") < n ? strcspn(t, "\r\n") : n;
+		if (n > sizeof(e->title)) n = sizeof(e->title);
+		memcpy(e->title, t, n);
+	}
+	e->hash = image_hash();
+	e->cylinders = args.cylinders;
+	e->heads = args.heads;
+	e->policy = args.policy;
+	e->sectors = args.sectors;
+	e->sector_len = args.length;
+	e->dmode = args.dmode;
+	e->offset1 = args.offset1;
+	e->offset2 = args.offset2;
+}
+
 static void read_track(track_t *track, int cyl, int hd, int fd) {
 	int s;
 	// for now, assume image is:
@@ -182,11 +500,9 @@ static void read_track(track_t *track, int cyl, int hd, int fd) {
 	int cyl = o / args.heads;
 	int hd = o % args.heads;
 #endif
-	if (args.policy == 0) { // "continuation" side 0 first, then side 1
-		off_t o;
-		//o = (cyl * args.heads + hd) * args.sectors * args.length;
-		o = (hd * args.cylinders + cyl) * args.sectors * args.length;
-		o = lseek(fd, o, SEEK_SET);
+	// "continuation" side 0 first, then side 1; or tracks skipped
+	if (args.policy == 0 || args.cyl_lo > 0 || args.head >= 0) {
+		off_t o = lseek(fd, track_offset(cyl, hd), SEEK_SET);
 		if (o < 0) {
 			perror(args.image_filename);
 			exit(1);
@@ -199,13 +515,7 @@ static void read_track(track_t *track, int cyl, int hd, int fd) {
 	track->sector_size_code = args.length_code;
 	track->status = TRACK_PROBED;
 	for (s = 0; s < args.sectors; ++s) {
-		int sn = s;	// assume no skew (1:1)
-		if (hd > 0 && args.sectbl2 != NULL) {
-			sn = args.sectbl2[s];
-		} else if (args.sectbl != NULL) {
-			sn = args.sectbl[s];
-		}
-		sector_t *sec = &track->sectors[sn];
+		sector_t *sec = raw_sector(track, hd, s);
 		sec->log_cyl = track->phys_cyl;
 		if (args.policy == 2) {
 			sec->log_head = 0;	// Kaypro special
@@ -227,7 +537,219 @@ static void read_track(track_t *track, int cyl, int hd, int fd) {
 			perror(args.image_filename);
 			exit(1);
 		}
+		if (n < args.length) { // short image (-f)
+			memset(sec->data + n, 0, args.length - n);
+		}
+	}
+}
+
+/*
+ * Reads back the IMD file and re-derives each track's sectors in
+ * raw-file order, undoing the skew and sector numbering, then checks
+ * the track hashes against those taken while reading RAW-FILE.
+ */
+static void verify_imd(void) {
+	static bool seen[MAX_CYLS][MAX_HEADS];
+	imd_file_t imd;
+	imd_track_t trk;
+	int errs = 0;
+	int tsize = args.sectors * args.length;
+	uint8_t *buf = malloc(tsize);
+	bool *got = malloc(args.sectors);
+	if (buf == NULL || got == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	imd_open(&imd, args.imd_filename);
+	while (imd_next_track(&imd, &trk)) {
+		int c = trk.cyl;
+		int h = trk.head;
+		if (c >= args.cylinders || h >= args.heads || seen[c][h] ||
+				trk.num_sectors != args.sectors ||
+				trk.sector_size != args.length) {
+			fprintf(stderr, "%s: verify: unexpected track "
+				"cyl %d head %d\n", args.imd_filename, c, h);
+			++errs;
+			continue;
+		}
+		seen[c][h] = true;
+		int base = h ? args.offset2 : args.offset1;
+		memset(got, 0, args.sectors);
+		int i;
+		for (i = 0; i < trk.num_sectors; ++i) {
+			int s = trk.smap[i] - base;
+			if (s < 0 || s >= args.sectors || got[s]) break;
+			got[s] = true;
+			imd_sector_data(&trk, i, buf + s * args.length);
+		}
+		if (i < trk.num_sectors ||
+				hash64(buf, tsize, 0) != track_hash[c][h]) {
+			fprintf(stderr, "%s: verify: cyl %d head %d differs\n",
+				args.imd_filename, c, h);
+			++errs;
+		}
+	}
+	imd_close(&imd);
+	for (int c = 0; c < args.cylinders; c++) {
+		for (int h = 0; h < args.heads; h++) {
+			if (!seen[c][h] && selected(c, h)) {
+				fprintf(stderr, "%s: verify: cyl %d head %d "
+					"missing\n", args.imd_filename, c, h);
+				++errs;
+			}
+		}
+	}
+	free(got);
+	free(buf);
+	if (errs) {
+		die("%s: verify failed", args.imd_filename);
+	}
+	if (args.verbose) {
+		printf("%s: verified, hash %016" PRIx64 "\n",
+			args.imd_filename, image_hash());
+	}
+}
+
+/*
+ * Outputs are written under temporary names (mkstemp() templates) and
+ * renamed into place when complete, so a crash never leaves a partial
+ * output under its real name. Temporary files left by die() are
+ * removed at exit.
+ */
+static char temp_file[2][PATH_MAX + 16];
+
+static void remove_temps(void) {
+	for (int i = 0; i < 2; ++i) {
+		if (temp_file[i][0] != '\0') unlink(temp_file[i]);
+	}
+}
+
+static int create_temp(char *tmpl) {
+	static bool registered;
+	int fd = mkstemp(tmpl);
+	if (fd < 0) {
+		die_errno("cannot create %s", tmpl);
+	}
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);	// as if by fopen()
+	if (!registered) {
+		atexit(remove_temps);
+		registered = true;
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (temp_file[i][0] == '\0') {
+			snprintf(temp_file[i], sizeof(temp_file[i]), "%s", tmpl);
+			break;
+		}
+	}
+	return fd;
+}
+
+static void forget_temp(const char *tmp) {
+	for (int i = 0; i < 2; ++i) {
+		if (strcmp(temp_file[i], tmp) == 0) temp_file[i][0] = '\0';
+	}
+}
+
+static void sync_fd(int fd, const char *name) {
+	if (fsync(fd) < 0) {
+		die_errno("cannot sync %s", name);
+	}
+}
+
+// fsync()s 'tmp' before the rename and the directory after it
+static bool sync_outputs(void) {
+	return args.durability == DURABLE_EACH ||
+		(args.durability == DURABLE_BATCH && args.batch == NULL);
+}
+
+static void commit_temp(const char *tmp, const char *name) {
+	if (sync_outputs()) {
+		int fd = open(tmp, O_RDONLY);
+		if (fd < 0) {
+			die_errno("cannot open %s", tmp);
+		}
+		sync_fd(fd, tmp);
+		close(fd);
+	}
+	if (rename(tmp, name) < 0) {
+		die_errno("cannot rename %s to %s", tmp, name);
+	}
+	forget_temp(tmp);
+	if (sync_outputs()) {
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s", name);
+		int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			die_errno("cannot open %s", dir);
+		}
+		sync_fd(fd, dir);
+		close(fd);
+	}
+}
+
+static void drop_temp(const char *tmp) {
+	unlink(tmp);
+	forget_temp(tmp);
+}
+
+/*
+ * Reads the -C comment from stdin, once. Multi-file modes call this
+ * before forking, so that every file gets the whole comment.
+ */
+static void read_comment(void) {
+	static bool done;
+	if (done) return;
+	done = true;
+	if (isatty(0)) {
+		fprintf(stderr, "Enter comment, terminated by EOF\n");
+	}
+
+	while (true) {
+		char buf[4096];
+		ssize_t count = read(0, buf, sizeof buf);
+		if (count == 0) break;
+		if (count < 0) {
+			die("read from stdin failed");
+		}
+
+		alloc_append(buf, count, &args.comment, &args.comment_len);
+	}
+}
+
+static void make_comment(disk_t *disk) {
+	make_disk_comment(PACKAGE_NAME, PACKAGE_VERSION, disk);
+
+	if (args.title != NULL) {
+		alloc_append(args.title, strlen(args.title),
+				&disk->comment, &disk->comment_len);
+	}
+	if (args.read_comment) {
+		read_comment();
+		if (args.comment_len > 0) {
+			alloc_append(args.comment, args.comment_len,
+					&disk->comment, &disk->comment_len);
+		}
+	}
+}
+
+/*
+ * Upper bound on the IMD size: every selected track written with
+ * cylinder and head maps and no compressed sectors. The header line
+ * is under 64 bytes.
+ */
+static off_t imd_size_bound(const disk_t *disk) {
+	off_t tracks = 0;
+	int cyl_hi = last_cyl(args.cylinders);
+	for (int cyl = args.cyl_lo; cyl <= cyl_hi; cyl++) {
+		for (int head = 0; head < args.heads; head++) {
+			tracks += selected(cyl, head);
+		}
 	}
+	return 64 + disk->comment_len + 1 + tracks * (5 + 3 * args.sectors
+		+ (off_t)args.sectors * (1 + args.length));
 }
 
 static void process_raw(void) {
@@ -251,38 +773,70 @@ static void process_raw(void) {
 
 	disk_t disk;
 	init_disk(&disk);
-	make_disk_comment(PACKAGE_NAME, PACKAGE_VERSION, &disk);
+	make_comment(&disk);
 
-	if (args.title != NULL) {
-		alloc_append(args.title, strlen(args.title),
-				&disk.comment, &disk.comment_len);
+	disk.num_phys_cyls = args.cylinders;
+	disk.num_phys_heads = args.heads;
+
+	uint8_t *tbuf = malloc(args.sectors * args.length);
+	if (tbuf == NULL) {
+		perror("malloc");
+		exit(1);
 	}
-	if (args.read_comment) {
-		if (isatty(0)) {
-			fprintf(stderr, "Enter comment, terminated by EOF\n");
-		}
 
-		while (true) {
-			char buf[4096];
-			ssize_t count = read(0, buf, sizeof buf);
-			if (count == 0) break;
-			if (count < 0) {
-				die("read from stdin failed");
+	FILE *manifest = NULL;
+	if (args.manifest != NULL) {
+		if (strcmp(args.manifest, "-") == 0) {
+			manifest = stdout;
+		} else {
+			manifest = fopen(args.manifest, "w");
+			if (manifest == NULL) {
+				die_errno("cannot open %s", args.manifest);
 			}
-
-			alloc_append(buf, count, &disk.comment, &disk.comment_len);
 		}
+		manifest_header(manifest);
+	}
+	report_t report;
+	if (args.report != NULL) {
+		rp_init(&report, stdout, strcmp(args.report, "cbor") == 0);
+		report_header(&report, &disk);
+	}
+	fingerprint_t fp;
+	fp_init(&fp);
+	tg_builder_t *tg = NULL;
+	if (args.trigrams != NULL) {
+		tg = tg_new(args.image_filename);
 	}
-
-	disk.num_phys_cyls = args.cylinders;
-	disk.num_phys_heads = args.heads;
 
 	FILE *image = NULL;
-	if (args.imd_filename != NULL) {
+	const char *out_name = args.imd_filename;
+	char tmp_imd[PATH_MAX + 16];
+	tmp_imd[0] = '\0';
+	if (args.delta != NULL) {
+		// IMD is only an intermediate for the delta
+		snprintf(tmp_imd, sizeof(tmp_imd), "%s.XXXXXX", out_name);
+	} else if (args.store != NULL && out_name == NULL) {
+		// IMD only goes into the store
+		snprintf(tmp_imd, sizeof(tmp_imd), "%s/raw2imd.XXXXXX",
+			args.store);
+	} else if (args.archive != NULL && out_name == NULL) {
+		snprintf(tmp_imd, sizeof(tmp_imd), "%s.XXXXXX", args.archive);
+	} else if (out_name != NULL) {
 		// FIXME: if the image exists already, load it
 		// (so the comment is preserved)
 
-		image = fopen(args.imd_filename, "wb");
+		// renamed into place once complete
+		snprintf(tmp_imd, sizeof(tmp_imd), "%s.XXXXXX", out_name);
+	}
+	if (tmp_imd[0] != '\0') {
+		int fd = create_temp(tmp_imd);
+		// contiguous allocation up front; the excess is trimmed on
+		// close (not all filesystems support this)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, imd_size_bound(&disk));
+		image = fdopen(fd, "wb");
+		args.imd_filename = tmp_imd;
+	}
+	if (args.imd_filename != NULL) {
 		if (image == NULL) {
 			die_errno("cannot open %s", args.imd_filename);
 		}
@@ -294,11 +848,31 @@ static void process_raw(void) {
 	// FIXME: if retrying, ensure we've moved the head across the disk
 	// FIXME: if retrying, turn the motor off and on (delay? close?)
 	// FIXME: pull this out to a read_disk function
-	for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+	int cyl_hi = last_cyl(disk.num_phys_cyls);
+	for (int cyl = args.cyl_lo; cyl <= cyl_hi; cyl++) {
 		for (int head = 0; head < disk.num_phys_heads; head++) {
 			track_t *track = &(disk.tracks[cyl][head]);
+			if (!selected(cyl, head)) continue;
 
 			read_track(track, cyl, head, dev_fd);
+			track_hash[cyl][head] = hash_track(track, head, tbuf);
+			if (manifest != NULL) {
+				manifest_track(track, cyl, head, manifest);
+			}
+			if (args.report != NULL) {
+				report_track(&report, track);
+			}
+			if (args.fingerprint != NULL) {
+				fingerprint_track(track, head, &fp);
+			}
+			if (tg != NULL) {
+				int base = head ? args.offset2 : args.offset1;
+				for (int s = 0; s < args.sectors; ++s) {
+					tg_add_sector(tg, cyl, head, base + s,
+						raw_sector(track, head, s)->data,
+						args.length);
+				}
+			}
 
 			if (image != NULL) {
 				write_imd_track(track, image);
@@ -307,12 +881,75 @@ static void process_raw(void) {
 		}
 	}
 
+	free(tbuf);
+	if (tg != NULL) {
+		tg_write(tg, args.trigrams);
+		tg_free(tg);
+	}
+	if (args.fingerprint != NULL) {
+		FILE *f = stdout;
+		if (strcmp(args.fingerprint, "-") != 0) {
+			f = fopen(args.fingerprint, "a");
+		}
+		if (f == NULL) {
+			die_errno("cannot open %s", args.fingerprint);
+		}
+		fp_write(&fp, args.image_filename, f);
+		if (f != stdout && fclose(f) != 0) {
+			die_errno("cannot write %s", args.fingerprint);
+		}
+	}
+	if (args.report != NULL) {
+		report_trailer(&report);
+	}
+	if (manifest != NULL) {
+		manifest_trailer(manifest);
+		if (manifest != stdout && fclose(manifest) != 0) {
+			die_errno("cannot write %s", args.manifest);
+		}
+	}
 	if (image != NULL) {
-		fclose(image);
+		if (fflush(image) != 0 ||
+				ftruncate(fileno(image), ftello(image)) < 0 ||
+				fclose(image) != 0) {
+			die_errno("cannot write %s", args.imd_filename);
+		}
 	}
 	close(dev_fd);
+	if (args.verify) {
+		verify_imd();
+	}
+	char name[PATH_MAX];
+	image_name(out_name, name, sizeof(name));
+	if (args.store != NULL) {
+		store_imd(args.store, args.imd_filename, name, args.verbose);
+	}
+	if (args.archive != NULL) {
+		cat_entry_t entry;
+		catalog_entry(&disk, name, &entry);
+		archive_add(args.archive, args.imd_filename, &entry);
+	}
+	if (args.delta != NULL) {
+		char tmp_delta[PATH_MAX + 16];
+		snprintf(tmp_delta, sizeof(tmp_delta), "%s.XXXXXX", out_name);
+		close(create_temp(tmp_delta));
+		delta_imd(args.delta, args.imd_filename, tmp_delta,
+			args.verbose);
+		commit_temp(tmp_delta, out_name);
+	}
+	if (tmp_imd[0] != '\0') {
+		if (args.delta == NULL && out_name != NULL) {
+			commit_temp(tmp_imd, out_name);
+		} else {
+			drop_temp(tmp_imd);
+		}
+	}
 	if (args.verbose) {
-		show_disk(&disk, args.verbose > 1, stdout);
+		if (args.show_disk) {
+			show_disk(&disk, args.verbose > 1, stdout);
+		} else {
+			dump_disk(&disk, args.verbose > 1, stdout);
+		}
 	}
 	free_disk(&disk);
 }
@@ -362,33 +999,2109 @@ static int *mkskew(int skew, int secs) {
 	return tbl_out;
 }
 
-static void usage(void) {
-	fprintf(stderr, "usage: raw2imd [OPTION]... RAW-FILE [IMAGE-FILE]\n");
-	fprintf(stderr, "  -5		 RAW-FILE is 5.25\" diskette (default)\n");
-	fprintf(stderr, "  -8		 RAW-FILE is 8\" diskette\n");
-	fprintf(stderr, "  -c NUM	 number of cylinders\n");
-	fprintf(stderr, "  -h NUM	 number of heads (sides)\n");
-	fprintf(stderr, "  -s NUM	 number of sectors/track\n");
-	fprintf(stderr, "  -l NUM	 sector length\n");
-	fprintf(stderr, "  -m		 RAW-FILE is MFM (i.e. double density)\n");
-	fprintf(stderr, "  -r NUM	 override data rate [250,300,500]\n");
-	fprintf(stderr, "  -L		 RAW-FILE is logdisk format (has geom)\n");
-	fprintf(stderr, "  -o		 sector number offset (1)\n");
-	fprintf(stderr, "  -O		 side 1 sector number offset (-o)\n");
-	fprintf(stderr, "  -k NUM	 physical sector skew (1)\n");
-	fprintf(stderr, "  -K NUM	 side 1 physical skew (-k)\n");
-	fprintf(stderr, "  -i		 ignore excess data in RAW-FILE\n");
-	fprintf(stderr, "  -f		 force using smaller RAW-FILE\n");
-	fprintf(stderr, "  -C		 read comment from stdin\n");
-	fprintf(stderr, "  -T STR	 use STR as comment\n");
-	fprintf(stderr, "  -v		 verbose output (multiple)\n");
-}
+/*
+ * Completes args for args.image_filename: reads the logdisk trailer
+ * if -L, checks the geometry and derives the sector size code, data
+ * mode, sector numbering and skew tables. Returns -1 if the geometry
+ * is missing or invalid, -2 if it was rejected with a message.
+ */
+static int setup_geometry(void) {
+	if (args.logdisk) {
+		if (snoop_media(args.image_filename) < 0) {
+			perror(args.image_filename);
+			return -1;
+		}
+	}
+	if (args.cylinders < 0 || args.heads < 0 ||
+			args.sectors < 0 || args.length < 0) {
+		return -1;
+	}
+	if (args.cylinders > MAX_CYLS || args.heads > MAX_HEADS ||
+			args.sectors > MAX_SECS) {
+		fprintf(stderr, "geometry too large (max %d/%d/%d)\n",
+			MAX_CYLS, MAX_HEADS, MAX_SECS);
+		return -2;
+	}
+	// the upper bound of --cyl is cut to the geometry by last_cyl()
+	if (args.cyl_lo >= args.cylinders || args.head >= args.heads) {
+		fprintf(stderr, "%s: --cyl/--head outside the disk geometry\n",
+			args.image_filename);
+		return -2;
+	}
+	switch (args.length) {
+	case 128: args.length_code = 0; break;
+	case 256: args.length_code = 1; break;
+	case 512: args.length_code = 2; break;
+	case 1024: args.length_code = 3; break;
+	default:
+		return -1;
+	}
+	if (args.size < 0) {
+		args.size = 5;
+	}
+	if (args.data_rate < 0) {
+		if (args.size == 8) {
+			args.dmode = args.mfm ? MFM_500K : FM_500K;
+		} else if (args.size == 5) {
+			args.dmode = args.mfm ? MFM_250K : FM_250K;
+		} else {
+			args.dmode = MFM_250K; // punt
+		}
+	} else switch (args.data_rate) {
+		case 250:
+			args.dmode = args.mfm ? MFM_250K : FM_250K;
+			break;
+		case 300:
+			args.dmode = args.mfm ? MFM_300K : FM_300K;
+			break;
+		case 500:
+			args.dmode = args.mfm ? MFM_500K : FM_500K;
+			break;
+		case 1000:
+			args.dmode = MFM_1000K;
+			args.mfm = 1;
+			break;
+	}
+	if (args.offset1 < 0) {
+		args.offset1 = 1; // default to industry-standard
+	}
+	if (args.offset2 < 0) {
+		args.offset2 = args.offset1;
+	}
+	if (abs(args.skew) > 1) { // physical skew - if specified
+		args.sectbl = mkskew(args.skew, args.sectors);
+	}
+	if (abs(args.skew2) > 1) {
+		args.sectbl2 = mkskew(args.skew2, args.sectors);
+	}
+
+	return 0;
+}
+
+/*
+ * Sets up the geometry for raw image 'file' (per -L, if given) and maps
+ * its sector data, without the logdisk trailer. Returns NULL for an
+ * empty image.
+ */
+static const uint8_t *map_raw(const char *file, size_t *size) {
+	struct stat stb;
+
+	args.image_filename = file;
+	if (setup_geometry() < 0) {
+		die("%s: missing or invalid geometry", file);
+	}
+	int fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stb) < 0) {
+		die_errno("cannot open %s", file);
+	}
+	*size = stb.st_size;
+	if (args.logdisk) {
+		*size = *size > 128 ? *size - 128 : 0;
+	}
+	if (*size == 0) {
+		close(fd);
+		return NULL;
+	}
+	const uint8_t *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		die_errno("cannot map %s", file);
+	}
+	close(fd);
+	return map;
+}
+
+/*
+ * --batch: converts each FILE, and each file under each DIR, to an IMD
+ * under OUTDIR (same relative path, ".imd" appended), in parallel.
+ * OUTDIR/.raw2imd-cache remembers what each output was made from, so
+ * a re-run only converts new or changed inputs.
+ *
+ * While a batch runs, the parent appends each finished output to
+ * OUTDIR/.raw2imd-journal, syncing once per group of entries rather
+ * than once per image. The journal is removed when the batch succeeds;
+ * after a crash, --resume skips everything it lists.
+ *
+ * --shard I/N converts only the I-th of N parts of the inputs, so N
+ * processes (on any machines sharing OUTDIR) can split a batch without
+ * talking to each other. Each shard keeps its own journal, cache and
+ * stats file (suffix ".I-of-N"); an unsharded run folds the caches
+ * of shards that are not running back into the main one.
+ */
+typedef struct {
+	char *in;
+	char *out;
+	off_t size;
+} batch_item_t;
+
+typedef struct {
+	batch_item_t *items;
+	size_t n;
+	size_t cap;
+	char cache[PATH_MAX];
+	uint64_t params;
+	char journal[PATH_MAX];
+	int journal_fd;
+	char *pending;	// journal lines not yet written
+	size_t npending;
+	size_t unsynced;	// entries since the last sync
+	time_t synced;
+} batch_t;
+
+#define SHARD_FILE_COST	4096	// per-file work, in bytes of input
+#define JOURNAL_GROUP	64	// entries per journal sync...
+#define JOURNAL_DELAY	1	// ...or seconds, whichever comes first
+
+static batch_t batch;
+static size_t batch_skip;	// length of "DIR/" for the directory walked
+static struct stat batch_out_st;
+
+static void batch_add(const char *in, const char *rel, off_t size) {
+	if (batch.n == batch.cap) {
+		batch.cap = batch.cap ? batch.cap * 2 : 256;
+		batch.items = realloc(batch.items,
+				batch.cap * sizeof(*batch.items));
+		if (batch.items == NULL) {
+			die("out of memory");
+		}
+	}
+	batch_item_t *it = &batch.items[batch.n++];
+	it->size = size;
+	it->in = strdup(in);
+	if (it->in == NULL ||
+			asprintf(&it->out, "%s/%s.imd", args.batch, rel) < 0) {
+		die("out of memory");
+	}
+}
+
+static int batch_walk(const char *path, const struct stat *st, int type,
+			struct FTW *ftw) {
+	if (type == FTW_D && st->st_dev == batch_out_st.st_dev &&
+			st->st_ino == batch_out_st.st_ino) {
+		return FTW_SKIP_SUBTREE;	// our own outputs
+	}
+	if (type == FTW_F && S_ISREG(st->st_mode)) {
+		batch_add(path, path + batch_skip, st->st_size);
+	}
+	return FTW_CONTINUE;
+}
+
+static int cmp_item(const void *a, const void *b) {
+	return strcmp(((const batch_item_t *)a)->in,
+			((const batch_item_t *)b)->in);
+}
+
+static int cmp_item_out(const void *a, const void *b) {
+	return strcmp(((const batch_item_t *)a)->out,
+			((const batch_item_t *)b)->out);
+}
+
+/*
+ * Drops inputs named more than once, and dies if two different inputs
+ * would be converted to the same output (e.g. a/x.raw and b/x.raw).
+ */
+static void batch_unique(void) {
+	qsort(batch.items, batch.n, sizeof(*batch.items), cmp_item_out);
+	size_t keep = 0;
+	for (size_t i = 0; i < batch.n; ++i) {
+		batch_item_t *it = &batch.items[i];
+		if (keep > 0 && strcmp(batch.items[keep - 1].out, it->out) == 0) {
+			if (strcmp(batch.items[keep - 1].in, it->in) != 0) {
+				die("%s and %s would both be converted to %s",
+					batch.items[keep - 1].in, it->in, it->out);
+			}
+			free(it->in);
+			free(it->out);
+			continue;
+		}
+		batch.items[keep++] = *it;
+	}
+	batch.n = keep;
+}
+
+static void batch_input(const char *file) {
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (stat(file, &st) < 0) {
+		die_errno("cannot open %s", file);
+	}
+	snprintf(path, sizeof(path), "%s", file);
+	if (!S_ISDIR(st.st_mode)) {
+		batch_add(file, basename(path), st.st_size);
+		return;
+	}
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+	// "/" already ends in the separator
+	batch_skip = len + (path[len - 1] != '/');
+	if (nftw(path, batch_walk, 64, FTW_PHYS | FTW_ACTIONRETVAL) < 0) {
+		die_errno("cannot read %s", path);
+	}
+}
+
+// --files-from: one FILE or DIR per line ("-": standard input)
+static void batch_list(const char *list) {
+	FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	if (f == NULL) {
+		die_errno("cannot open %s", list);
+	}
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t got;
+	while ((got = getline(&line, &len, f)) > 0) {
+		if (line[got - 1] == '\n') line[--got] = '\0';
+		if (got > 0) batch_input(line);
+	}
+	free(line);
+	if (f != stdin) fclose(f);
+}
+
+typedef struct {
+	uint64_t key;	// hash of the output path under OUTDIR
+	size_t item;
+} shard_key_t;
+
+static int cmp_shard_key(const void *a, const void *b) {
+	const shard_key_t *x = a;
+	const shard_key_t *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->item < y->item ? -1 : x->item > y->item;
+}
+
+/*
+ * Keeps only the items of shard args.shard of args.shards. Items are
+ * laid out in the order of a hash of their path relative to OUTDIR
+ * (the same on every machine), each taking up its size plus a little
+ * per-file overhead, and the line is cut into equal lengths; an item
+ * belongs to the shard its midpoint falls in. Returns the shard's
+ * total size.
+ */
+static off_t batch_shard(void) {
+	shard_key_t *keys = malloc((batch.n + 1) * sizeof(*keys));
+	if (keys == NULL) {
+		die("out of memory");
+	}
+	size_t skip = strlen(args.batch) + 1;
+	uint64_t total = 0;
+	for (size_t i = 0; i < batch.n; ++i) {
+		const char *rel = batch.items[i].out + skip;
+		keys[i].key = hash64(rel, strlen(rel), 0);
+		keys[i].item = i;
+		total += batch.items[i].size + SHARD_FILE_COST;
+	}
+	qsort(keys, batch.n, sizeof(*keys), cmp_shard_key);
+
+	uint64_t part = total / args.shards + 1;
+	uint64_t at = 0;
+	bool *mine = calloc(batch.n + 1, sizeof(*mine));
+	if (mine == NULL) {
+		die("out of memory");
+	}
+	for (size_t i = 0; i < batch.n; ++i) {
+		uint64_t w = batch.items[keys[i].item].size + SHARD_FILE_COST;
+		mine[keys[i].item] = (at + w / 2) / part == args.shard - 1;
+		at += w;
+	}
+	size_t keep = 0;
+	off_t size = 0;
+	for (size_t i = 0; i < batch.n; ++i) {
+		if (mine[i]) {
+			size += batch.items[i].size;
+			batch.items[keep++] = batch.items[i];
+		} else {
+			free(batch.items[i].in);
+			free(batch.items[i].out);
+		}
+	}
+	batch.n = keep;
+	free(mine);
+	free(keys);
+	return size;
+}
+
+// OUTDIR/.raw2imd-NAME, plus ".I-of-N" for a shard
+static void batch_file(char *buf, size_t len, const char *name) {
+	if (args.shards > 0) {
+		snprintf(buf, len, "%s/.raw2imd-%s.%d-of-%d", args.batch, name,
+			args.shard, args.shards);
+	} else {
+		snprintf(buf, len, "%s/.raw2imd-%s", args.batch, name);
+	}
+}
+
+/*
+ * A running shard holds an exclusive flock() on its lock file
+ * (OUTDIR/.raw2imd-lock.I-of-N) for as long as it may append to its
+ * cache. Returns the locked descriptor, or -1 if 'wait' is false and
+ * the shard is running.
+ */
+static int shard_lock(const char *path, bool wait) {
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		die_errno("cannot open %s", path);
+	}
+	if (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) < 0) {
+		if (!wait && errno == EWOULDBLOCK) {
+			close(fd);
+			return -1;
+		}
+		die_errno("cannot lock %s", path);
+	}
+	return fd;
+}
+
+/*
+ * Adds the shards' caches. An unsharded run also locks those of
+ * shards that are not running (lock[i] >= 0), so it can take them
+ * over once it has compacted; the rest it only reads.
+ */
+static int *batch_merge_shards(cache_t *cache, glob_t *g) {
+	char pat[PATH_MAX];
+	snprintf(pat, sizeof(pat), "%s/.raw2imd-cache.*-of-*", args.batch);
+	if (glob(pat, 0, NULL, g) != 0) {
+		g->gl_pathc = 0;
+		return NULL;
+	}
+	int *lock = malloc(g->gl_pathc * sizeof(*lock));
+	if (lock == NULL) {
+		die("out of memory");
+	}
+	for (size_t i = 0; i < g->gl_pathc; ++i) {
+		lock[i] = -1;
+		if (args.shards == 0) {
+			char path[PATH_MAX];
+			const char *shard = strrchr(g->gl_pathv[i], '.');
+			snprintf(path, sizeof(path), "%s/.raw2imd-lock%s",
+				args.batch, shard);
+			lock[i] = shard_lock(path, false);
+		}
+		cache_merge(cache, g->gl_pathv[i]);
+	}
+	return lock;
+}
+
+// everything that changes the IMD written for a given input
+static uint64_t batch_params(void) {
+	char buf[1024];
+	int n = snprintf(buf, sizeof(buf), "%s %d %d %d %d %d %d %d %d %d %d "
+		"%d %d %d %d %d %d %d %d %d %016" PRIx64 " %d %s %d %s",
+		PACKAGE_VERSION, args.size,
+		args.policy, args.cylinders, args.heads, args.sectors,
+		args.length, args.mfm, args.data_rate, args.skew, args.skew2,
+		args.offset1, args.offset2, args.logdisk, args.force,
+		args.ignore, args.cyl_lo, args.cyl_hi, args.head,
+		args.read_comment, hash64(args.comment, args.comment_len, 0),
+		args.delta != NULL,
+		args.delta ? args.delta : "", args.title != NULL,
+		args.title ? args.title : "");
+	return hash64(buf, n < (int)sizeof(buf) ? n : sizeof(buf), 0);
+}
+
+static uint64_t file_hash(const char *path) {
+	size_t size;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		die_errno("cannot open %s", path);
+	}
+	size = st.st_size;
+	uint64_t h = hash64("", 0, 0);
+	if (size > 0) {
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			die_errno("cannot map %s", path);
+		}
+		h = hash64(map, size, 0);
+		munmap(map, size);
+	}
+	close(fd);
+	return h;
+}
+
+static void cache_identity(cache_entry_t *e, const struct stat *st) {
+	e->size = st->st_size;
+	e->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000 +
+			st->st_mtim.tv_nsec;
+	e->ino = st->st_ino;
+}
+
+// whether item 'it' has a current output; may refresh its entry
+static bool batch_current(const cache_t *c, const batch_item_t *it) {
+	struct stat st, out_st;
+	const cache_entry_t *e = cache_find(c, it->out);
+	if (e == NULL || e->params != batch.params ||
+			stat(it->in, &st) < 0 || stat(it->out, &out_st) < 0 ||
+			(uint64_t)out_st.st_size != e->out_size) {
+		return false;
+	}
+	cache_entry_t now = *e;
+	cache_identity(&now, &st);
+	if (now.size == e->size && now.mtime_ns == e->mtime_ns &&
+			now.ino == e->ino) {
+		return true;
+	}
+	// touched or copied: the same content is still current
+	if (!args.cache_hash || e->content == 0 || now.size != e->size ||
+			file_hash(it->in) != e->content) {
+		return false;
+	}
+	cache_append(batch.cache, &now);
+	return true;
+}
+
+static void make_parents(const char *path) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + 1; *p; ++p) {
+		if (*p != '/') continue;
+		*p = '\0';
+		if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+			die_errno("cannot create %s", dir);
+		}
+		*p = '/';
+	}
+}
+
+static int batch_one(int i, void *arg) {
+	batch_item_t *it = &((batch_item_t *)arg)[i];
+	struct stat st, out_st;
+	cache_entry_t e;
+
+	if (stat(it->in, &st) < 0) {
+		die_errno("cannot open %s", it->in);
+	}
+	make_parents(it->out);
+	args.image_filename = it->in;
+	args.imd_filename = it->out;
+	int err = setup_geometry();
+	if (err < 0) {
+		if (err == -1) {
+			fprintf(stderr, "%s: missing or invalid geometry\n",
+				it->in);
+		}
+		return 1;
+	}
+	process_raw();
+	if (stat(it->out, &out_st) < 0) {
+		die_errno("cannot open %s", it->out);
+	}
+	memset(&e, 0, sizeof(e));
+	e.out = it->out;
+	cache_identity(&e, &st);
+	e.content = args.cache_hash ? file_hash(it->in) : 0;
+	e.params = batch.params;
+	e.out_size = out_st.st_size;
+	cache_append(batch.cache, &e);
+	return 0;
+}
+
+static int cmp_string(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Removes items listed in the journal for the same parameters, and
+ * returns how many were removed. Lines are "j1 PARAMS OUT".
+ */
+static size_t journal_skip(size_t n) {
+	FILE *f = fopen(batch.journal, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) return 0;
+		die_errno("cannot open %s", batch.journal);
+	}
+	char **done = NULL;
+	size_t ndone = 0, max = 0;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t got;
+	while ((got = getline(&line, &len, f)) > 0) {
+		char *end;
+		if (line[got - 1] != '\n') break;	// torn last write
+		line[got - 1] = '\0';
+		if (strncmp(line, "j1 ", 3) != 0) continue;
+		uint64_t params = strtoull(line + 3, &end, 16);
+		if (*end != ' ' || params != batch.params) continue;
+		if (ndone == max) {
+			max = max ? max * 2 : 256;
+			done = realloc(done, max * sizeof(*done));
+			if (done == NULL) {
+				die("out of memory");
+			}
+		}
+		if ((done[ndone++] = strdup(end + 1)) == NULL) {
+			die("out of memory");
+		}
+	}
+	free(line);
+	fclose(f);
+	qsort(done, ndone, sizeof(*done), cmp_string);
+
+	size_t keep = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (ndone == 0 || bsearch(&batch.items[i].out, done, ndone,
+				sizeof(*done), cmp_string) == NULL) {
+			batch.items[keep++] = batch.items[i];
+		}
+	}
+	for (size_t i = 0; i < ndone; ++i) {
+		free(done[i]);
+	}
+	free(done);
+	return n - keep;
+}
+
+static void journal_flush(bool sync) {
+	// the outputs must be durable before the journal says they exist
+	if (sync && args.durability == DURABLE_BATCH && batch.npending > 0 &&
+			syncfs(batch.journal_fd) < 0) {
+		die_errno("cannot sync %s", args.batch);
+	}
+	if (batch.npending > 0) {
+		if (write(batch.journal_fd, batch.pending, batch.npending)
+				!= (ssize_t)batch.npending) {
+			die_errno("cannot write %s", batch.journal);
+		}
+		batch.npending = 0;
+	}
+	if (sync && batch.unsynced > 0) {
+		if (fdatasync(batch.journal_fd) < 0) {
+			die_errno("cannot sync %s", batch.journal);
+		}
+		batch.unsynced = 0;
+		batch.synced = time(NULL);
+	}
+}
+
+static void journal_done(int i, bool ok, void *arg) {
+	batch_item_t *it = &((batch_item_t *)arg)[i];
+	if (!ok) return;
+	size_t len = strlen(it->out) + 24;
+	char *p = realloc(batch.pending, batch.npending + len);
+	if (p == NULL) {
+		die("out of memory");
+	}
+	batch.pending = p;
+	batch.npending += snprintf(p + batch.npending, len, "j1 %016llx %s\n",
+			(unsigned long long)batch.params, it->out);
+	++batch.unsynced;
+	if (batch.unsynced >= JOURNAL_GROUP ||
+			time(NULL) - batch.synced >= JOURNAL_DELAY) {
+		journal_flush(true);
+	}
+}
+
+static int run_batch(int n, char **files) {
+	cache_t cache;
+	glob_t shards;
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (mkdir(args.batch, 0777) < 0 && errno != EEXIST) {
+		die_errno("cannot create %s", args.batch);
+	}
+	if (stat(args.batch, &batch_out_st) < 0) {
+		die_errno("cannot open %s", args.batch);
+	}
+	for (int i = 0; i < n; ++i) {
+		batch_input(files[i]);
+	}
+	if (args.files_from != NULL) {
+		batch_list(args.files_from);
+	}
+	batch_unique();
+	if (args.read_comment) {
+		read_comment();	// not once per job
+	}
+	off_t bytes = 0;
+	if (args.shards > 0) {
+		bytes = batch_shard();
+	} else {
+		for (size_t i = 0; i < batch.n; ++i) bytes += batch.items[i].size;
+	}
+	qsort(batch.items, batch.n, sizeof(*batch.items), cmp_item);
+
+	batch.params = batch_params();
+	snprintf(batch.cache, sizeof(batch.cache), "%s/.raw2imd-cache",
+		args.batch);
+	cache_open(&cache, batch.cache);
+	int lock = -1;
+	if (args.shards > 0) {
+		// shards never rewrite the main cache, only append to their own
+		char path[PATH_MAX];
+		batch_file(path, sizeof(path), "lock");
+		lock = shard_lock(path, true);
+		batch_file(batch.cache, sizeof(batch.cache), "cache");
+	}
+	int *shard_locks = batch_merge_shards(&cache, &shards);
+	size_t todo = 0;
+	for (size_t i = 0; i < batch.n; ++i) {
+		if (!batch_current(&cache, &batch.items[i])) {
+			batch.items[todo++] = batch.items[i];
+		}
+	}
+
+	batch_file(batch.journal, sizeof(batch.journal), "journal");
+	size_t resumed = args.resume ? journal_skip(todo) : 0;
+	todo -= resumed;
+	batch.journal_fd = open(batch.journal, O_WRONLY | O_CREAT | O_APPEND
+			| (args.resume ? 0 : O_TRUNC), 0666);
+	if (batch.journal_fd < 0) {
+		die_errno("cannot open %s", batch.journal);
+	}
+	batch.synced = time(NULL);
+	int failed = run_indexed_done(todo, args.jobs, batch_one,
+			journal_done, batch.items);
+	journal_flush(true);
+	close(batch.journal_fd);
+	if (args.shards == 0) {
+		cache_compact(&cache);
+	}
+	for (size_t i = 0; i < shards.gl_pathc; ++i) {
+		if (shard_locks[i] < 0) continue;
+		unlink(shards.gl_pathv[i]);
+		close(shard_locks[i]);
+	}
+	if (shards.gl_pathc > 0) globfree(&shards);
+	free(shard_locks);
+	if (lock >= 0) close(lock);
+	cache_close(&cache);
+	if (failed == 0 && unlink(batch.journal) < 0) {
+		die_errno("cannot remove %s", batch.journal);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	char stats[256];
+	snprintf(stats, sizeof(stats), "%zu files, %jd bytes, %zu converted, "
+		"%zu up to date, %zu resumed, %d failed, %.1f s\n", batch.n,
+		(intmax_t)bytes, todo - failed, batch.n - todo - resumed,
+		resumed, failed, (t1.tv_sec - t0.tv_sec) +
+		(t1.tv_nsec - t0.tv_nsec) / 1e9);
+	if (args.shards > 0) {
+		char path[PATH_MAX];
+		batch_file(path, sizeof(path), "stats");
+		FILE *f = fopen(path, "w");
+		if (f == NULL || fputs(stats, f) < 0 || fclose(f) != 0) {
+			die_errno("cannot write %s", path);
+		}
+	}
+	if (args.verbose) {
+		if (args.shards > 0) {
+			fprintf(stderr, "%s: shard %d/%d: %s", args.batch,
+				args.shard, args.shards, stats);
+		} else {
+			fprintf(stderr, "%s: %s", args.batch, stats);
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+/*
+ * Fills in a CP/M disk description for a mapped raw image: the
+ * raw file's track order is CP/M's, with the -p policy already applied.
+ */
+static void cpm_disk(cpm_disk_t *d, const uint8_t *map, size_t size) {
+	memset(d, 0, sizeof(*d));
+	d->image = map;
+	d->size = size;
+	d->spt = args.sectors;
+	d->seclen = args.length;
+	d->xlt = NULL;
+	if (abs(args.lskew) > 1) {
+		d->xlt = mkskew(args.lskew, args.sectors);
+	}
+	d->bls = args.dpb_bls;
+	d->dirents = args.dpb_dirents;
+	d->off = args.dpb_off;
+	cpm_default_dpb(d);
+}
+
+static int cpm_file(const char *file) {
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+	size_t size;
+	cpm_disk_t d;
+
+	const uint8_t *map = map_raw(file, &size);
+	if (map == NULL) return 1;
+	cpm_disk(&d, map, size);
+	if (cpm_init(&d) < 0) {
+		die("%s: disk parameters do not fit the image", file);
+	}
+	snprintf(path, sizeof(path), "%s", file);
+	snprintf(dir, sizeof(dir), "%s/%s", args.cpm_dir, basename(path));
+	cpm_extract(&d, dir, args.verbose);
+	free((void *)d.xlt);
+	munmap((void *)map, size);
+	return 0;
+}
+
+/*
+ * --guess-skew: the raw file holds sectors in their numbered order, so
+ * a physical skew (-k) does not change what the data reads as; the
+ * CP/M logical skew does. Each distinct mkskew() table is scored by
+ * cpm_score() on the mapped image, candidates in parallel.
+ */
+typedef struct {
+	cpm_disk_t disk;
+	const cpm_model_t *model;
+	int skews[2 * MAX_SECS];
+	double *scores;		// shared with the scoring children
+} skew_guess_t;
+
+static int score_skew(int i, void *arg) {
+	skew_guess_t *g = arg;
+	cpm_disk_t d = g->disk;
+	d.xlt = NULL;
+	if (g->skews[i] > 1 || g->skews[i] < -1) {
+		d.xlt = mkskew(g->skews[i], d.spt);
+	}
+	g->scores[i] = cpm_score(&d, g->model);
+	return 0;
+}
+
+static int guess_skew_file(const char *file) {
+	skew_guess_t g;
+	size_t size;
+	int n = 0;
+
+	args.lskew = 0;		// whatever the trailer says
+	args.lskew_set = true;
+	const uint8_t *map = map_raw(file, &size);
+	if (map == NULL) return 1;
+	cpm_disk(&g.disk, map, size);
+	if (cpm_init(&g.disk) < 0) {
+		die("%s: disk parameters do not fit the image", file);
+	}
+	cpm_model_t *model = malloc(sizeof(*model));
+	if (model == NULL) {
+		die("out of memory");
+	}
+	cpm_model(&g.disk, model);
+	g.model = model;
+
+	// 1:1, then skews whose tables differ from all before them
+	int spt = g.disk.spt;
+	int **tbls = calloc(2 * spt, sizeof(*tbls));
+	if (tbls == NULL) {
+		die("out of memory");
+	}
+	g.skews[n++] = 1;
+	for (int k = 2; k < spt; ++k) {
+		for (int sign = 1; sign >= -1; sign -= 2) {
+			int *t = mkskew(sign * k, spt);
+			bool dup = true;
+			for (int s = 0; s < spt && dup; ++s) {
+				dup = (t[s] == s);
+			}
+			for (int j = 1; j < n && !dup; ++j) {
+				dup = memcmp(t, tbls[j], spt * sizeof(int)) == 0;
+			}
+			if (dup) {
+				free(t);
+				continue;
+			}
+			tbls[n] = t;
+			g.skews[n++] = sign * k;
+		}
+	}
+	g.scores = shared_alloc(n * sizeof(double));
+	// files already run in parallel: score candidates in turn
+	int jobs = args.nfiles > 1 ? 1 : args.jobs;
+	if (run_indexed(n, jobs, score_skew, &g) != 0) {
+		die("%s: scoring failed", file);
+	}
+
+	int best = 0;
+	for (int i = 0; i < n; ++i) {
+		if (args.verbose) {
+			printf("%s: lskew %d score %.1f\n", file, g.skews[i],
+				g.scores[i]);
+		}
+		if (g.scores[i] > g.scores[best]) best = i;
+	}
+	printf("%s: lskew %d\n", file, g.skews[best]);
+
+	for (int i = 0; i < n; ++i) {
+		free(tbls[i]);
+	}
+	free(tbls);
+	munmap(g.scores, n * sizeof(double));
+	free(model);
+	free((void *)g.disk.xlt);
+	munmap((void *)map, size);
+	return 0;
+}
+
+/*
+ * --reraw: rewrites RAW-FILE in another raw layout, i.e. 2-side policy
+ * (track order) and sector order, without going through a disk_t.
+ * Sectors are in logical (numbered) order, physical (skewed, per
+ * -k/-K) order, or CP/M order (the order CP/M reads them through its
+ * logical skew, --lskew, on tracks after the reserved ones).
+ * Whole tracks that keep their sector order move as runs with
+ * copy_file_range(); OUT may be RAW-FILE itself, in which case tracks
+ * are permuted in place, one cycle at a time.
+ */
+enum { ORDER_LOGICAL, ORDER_PHYS, ORDER_CPM };
+
+typedef struct {
+	int in_fd;
+	int out_fd;
+	const uint8_t *map;
+	size_t size;
+	size_t tsize;
+	size_t off;		// CP/M reserved tracks, in input order
+	// out position -> in position, per head; CP/M data tracks
+	// use the second half (see reraw_table())
+	int perm[2 * MAX_HEADS][MAX_SECS];
+	bool identity[2 * MAX_HEADS];
+} reraw_t;
+
+// position of logical sector 's' within a track in 'order'
+static int order_pos(int order, const int *tbl, const int *xlt_inv, int s) {
+	switch (order) {
+	case ORDER_PHYS:
+		return tbl != NULL ? tbl[s] : s;
+	case ORDER_CPM:
+		return xlt_inv != NULL ? xlt_inv[s] : s;
+	}
+	return s;
+}
+
+static void reraw_perm(reraw_t *r) {
+	int *xlt_inv = NULL;
+	r->off = 0;
+	if (args.in_order == ORDER_CPM || args.out_order == ORDER_CPM) {
+		r->off = args.dpb_off >= 0 ? args.dpb_off : 2;
+		if (abs(args.lskew) > 1) {
+			int *xlt = mkskew(args.lskew, args.sectors);
+			xlt_inv = malloc(args.sectors * sizeof(int));
+			if (xlt_inv == NULL) {
+				die("out of memory");
+			}
+			for (int ls = 0; ls < args.sectors; ++ls) {
+				xlt_inv[xlt[ls]] = ls;
+			}
+			free(xlt);
+		}
+	}
+	for (int m = 0; m < 2 * MAX_HEADS; ++m) {
+		int hd = m % MAX_HEADS;
+		bool data = m >= MAX_HEADS;
+		const int *tbl = (hd > 0 && args.sectbl2 != NULL) ?
+				args.sectbl2 : args.sectbl;
+		const int *inv = data ? xlt_inv : NULL;
+		r->identity[m] = true;
+		for (int s = 0; s < args.sectors; ++s) {
+			int in = order_pos(args.in_order, tbl, inv, s);
+			int out = order_pos(args.out_order, tbl, inv, s);
+			r->perm[m][out] = in;
+			if (in != out) r->identity[m] = false;
+		}
+	}
+	free(xlt_inv);
+}
+
+// table for input track number 'src' on head 'hd'
+static int reraw_table(const reraw_t *r, size_t src, int hd) {
+	return (src >= r->off ? MAX_HEADS : 0) + hd;
+}
+
+// out track number -> cylinder and head, per the output policy
+static void reraw_track(int t, int *cyl, int *hd) {
+	if (args.out_policy == 0) {
+		*hd = t / args.cylinders;
+		*cyl = t % args.cylinders;
+	} else {
+		*cyl = t / args.heads;
+		*hd = t % args.heads;
+	}
+}
+
+static void reraw_sectors(const reraw_t *r, int m, const uint8_t *in,
+			uint8_t *out) {
+	for (int q = 0; q < args.sectors; ++q) {
+		memcpy(out + (size_t)q * args.length,
+			in + (size_t)r->perm[m][q] * args.length, args.length);
+	}
+}
+
+// copies 'len' bytes unchanged, in the kernel if it can
+static void reraw_copy(const reraw_t *r, off_t src, off_t dst, size_t len) {
+	if (src >= (off_t)r->size) return;	// short input: left as a hole
+	if (len > r->size - src) len = r->size - src;
+	while (len > 0) {
+		ssize_t n = copy_file_range(r->in_fd, &src, r->out_fd, &dst,
+				len, 0);
+		if (n <= 0) break;
+		len -= n;
+	}
+	if (len > 0 && pwrite(r->out_fd, r->map + src, len, dst) != len) {
+		die_errno("cannot write %s", args.reraw);
+	}
+}
+
+static void reraw_copy_tracks(reraw_t *r) {
+	size_t ntracks = (size_t)args.cylinders * args.heads;
+	uint8_t *buf = malloc(r->tsize);
+	if (buf == NULL) {
+		die("out of memory");
+	}
+	off_t run_src = 0, run_dst = 0;
+	size_t run_len = 0;
+	for (size_t t = 0; t < ntracks; ++t) {
+		int cyl, hd;
+		reraw_track(t, &cyl, &hd);
+		off_t src = track_offset(cyl, hd);
+		off_t dst = t * r->tsize;
+		int m = reraw_table(r, src / r->tsize, hd);
+		if (r->identity[m]) {
+			if (run_len > 0 && src == run_src + (off_t)run_len) {
+				run_len += r->tsize;
+				continue;
+			}
+			if (run_len > 0) reraw_copy(r, run_src, run_dst, run_len);
+			run_src = src;
+			run_dst = dst;
+			run_len = r->tsize;
+			continue;
+		}
+		if (src + r->tsize > r->size) continue;
+		reraw_sectors(r, m, r->map + src, buf);
+		if (pwrite(r->out_fd, buf, r->tsize, dst) != r->tsize) {
+			die_errno("cannot write %s", args.reraw);
+		}
+	}
+	if (run_len > 0) reraw_copy(r, run_src, run_dst, run_len);
+	if (ftruncate(r->out_fd, ntracks * r->tsize) < 0) {
+		die_errno("cannot write %s", args.reraw);
+	}
+	free(buf);
+}
+
+static void reraw_read(const reraw_t *r, uint8_t *buf, off_t off) {
+	if (pread(r->out_fd, buf, r->tsize, off) != r->tsize) {
+		die_errno("cannot read %s", args.reraw);
+	}
+}
+
+static void reraw_write(const reraw_t *r, int m, const uint8_t *in,
+			uint8_t *tmp, off_t off) {
+	const uint8_t *out = in;
+	if (!r->identity[m]) {
+		reraw_sectors(r, m, in, tmp);
+		out = tmp;
+	}
+	if (pwrite(r->out_fd, out, r->tsize, off) != r->tsize) {
+		die_errno("cannot write %s", args.reraw);
+	}
+}
+
+/*
+ * Follows each cycle of the track permutation, holding one track
+ * aside, so memory use is a few tracks whatever the image size.
+ */
+static void reraw_in_place(reraw_t *r) {
+	size_t ntracks = (size_t)args.cylinders * args.heads;
+	if (r->size < ntracks * r->tsize) {
+		die("%s: image too small to reorder in place", args.reraw);
+	}
+	uint8_t *held = malloc(r->tsize);
+	uint8_t *cur = malloc(r->tsize);
+	uint8_t *tmp = malloc(r->tsize);
+	uint8_t *done = calloc(ntracks, 1);
+	if (held == NULL || cur == NULL || tmp == NULL || done == NULL) {
+		die("out of memory");
+	}
+	for (size_t start = 0; start < ntracks; ++start) {
+		if (done[start]) continue;
+		int cyl, hd;
+		reraw_track(start, &cyl, &hd);
+		size_t src = track_offset(cyl, hd) / r->tsize;
+		done[start] = 1;
+		int m = reraw_table(r, src, hd);
+		if (src == start) {	// stays put, maybe reordered inside
+			if (!r->identity[m]) {
+				reraw_read(r, cur, start * r->tsize);
+				reraw_write(r, m, cur, tmp, start * r->tsize);
+			}
+			continue;
+		}
+		reraw_read(r, held, start * r->tsize);
+		size_t dst = start;
+		while (src != start) {
+			reraw_read(r, cur, src * r->tsize);
+			reraw_write(r, reraw_table(r, src, hd), cur, tmp,
+				dst * r->tsize);
+			done[src] = 1;
+			dst = src;
+			reraw_track(dst, &cyl, &hd);
+			src = track_offset(cyl, hd) / r->tsize;
+		}
+		// 'held' is the track at 'start', which goes to 'dst'
+		reraw_write(r, reraw_table(r, start, hd), held, tmp,
+			dst * r->tsize);
+	}
+	free(done);
+	free(tmp);
+	free(cur);
+	free(held);
+}
+
+/*
+ * Returns the logdisk trailer 'trailer' with its policy ('i') and
+ * logical skew ('l') fields set to 'policy' and 'lskew'.
+ */
+static void reraw_trailer(const char *trailer, int policy, int lskew,
+			char *out) {
+	int n = 0;
+	const char *p = trailer;
+	memset(out, 0, 128);
+	while (*p != '\n' && *p != '\0' && p < trailer + 127) {
+		char *end;
+		long v = strtol(p, &end, 10);
+		if (end == p || *end == '\0') break;
+		if (*end == 'i') v = policy;
+		if (*end == 'l') v = lskew;
+		n += snprintf(out + n, 128 - n, "%ld%c", v, *end);
+		p = end + 1;
+	}
+	if (n < 127) out[n] = '\n';
+}
+
+static void reraw(void) {
+	struct stat in_st, out_st;
+	reraw_t r;
+	char trailer[128], fixed[128];
+
+	memset(&r, 0, sizeof(r));
+	r.map = map_raw(args.image_filename, &r.size);
+	if (args.out_policy < 0) args.out_policy = args.policy;
+	r.tsize = (size_t)args.sectors * args.length;
+	r.in_fd = open(args.image_filename, O_RDONLY);
+	if (r.in_fd < 0 || fstat(r.in_fd, &in_st) < 0) {
+		die_errno("cannot open %s", args.image_filename);
+	}
+	if (args.logdisk) {
+		if (pread(r.in_fd, trailer, sizeof(trailer), r.size) !=
+				sizeof(trailer)) {
+			die_errno("cannot read %s", args.image_filename);
+		}
+		// CP/M order output has the logical skew applied
+		reraw_trailer(trailer, args.out_policy,
+			args.out_order == ORDER_CPM ? 0 : args.lskew, fixed);
+	}
+	reraw_perm(&r);
+	bool in_place = stat(args.reraw, &out_st) == 0 &&
+			out_st.st_dev == in_st.st_dev &&
+			out_st.st_ino == in_st.st_ino;
+	r.out_fd = open(args.reraw, in_place ? O_RDWR :
+			O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (r.out_fd < 0) {
+		die_errno("cannot open %s", args.reraw);
+	}
+	if (in_place) {
+		reraw_in_place(&r);
+	} else {
+		reraw_copy_tracks(&r);
+	}
+	if (args.logdisk) {
+		off_t end = (off_t)args.cylinders * args.heads * r.tsize;
+		if (in_place) end = r.size;
+		if (pwrite(r.out_fd, fixed, sizeof(fixed), end) !=
+				sizeof(fixed)) {
+			die_errno("cannot write %s", args.reraw);
+		}
+	}
+	if (close(r.out_fd) < 0) {
+		die_errno("cannot write %s", args.reraw);
+	}
+	close(r.in_fd);
+	if (r.map != NULL) munmap((void *)r.map, r.size);
+}
+
+/*
+ * Maps 'file' as a flat image in cylinder/head order for FAT: IMDs are
+ * flattened, raw files are used as is unless -L or a geometry puts
+ * their tracks in another order (-p 0). Returns a malloc'd or mapped
+ * buffer; *mapped tells which.
+ */
+static uint8_t *fat_image(const char *file, size_t *size, bool *mapped) {
+	char magic[4];
+	struct stat stb;
+
+	*mapped = false;
+	int fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stb) < 0) {
+		die_errno("cannot open %s", file);
+	}
+	ssize_t n = read(fd, magic, sizeof(magic));
+	close(fd);
+	if (n == sizeof(magic) && memcmp(magic, "IMD ", 4) == 0) {
+		imd_file_t imd;
+		char *buf = NULL;
+		imd_open(&imd, file);
+		FILE *f = open_memstream(&buf, size);
+		if (f == NULL) {
+			die_errno("open_memstream");
+		}
+		imd_write_flat(&imd, f);
+		fclose(f);
+		imd_close(&imd);
+		return (uint8_t *)buf;
+	}
+	if (args.logdisk || args.cylinders > 0) {
+		const uint8_t *map = map_raw(file, size);
+		if (map == NULL) return NULL;
+		if (args.policy != 0 || args.heads < 2) {
+			*mapped = true;
+			return (uint8_t *)map;
+		}
+		size_t tsize = (size_t)args.sectors * args.length;
+		uint8_t *buf = calloc(args.cylinders * args.heads, tsize);
+		if (buf == NULL) {
+			die("out of memory");
+		}
+		uint8_t *p = buf;
+		for (int cyl = 0; cyl < args.cylinders; cyl++) {
+			for (int head = 0; head < args.heads; head++) {
+				size_t off = track_offset(cyl, head);
+				if (off + tsize <= *size) {
+					memcpy(p, map + off, tsize);
+				}
+				p += tsize;
+			}
+		}
+		munmap((void *)map, *size);
+		*size = p - buf;
+		return buf;
+	}
+	*size = stb.st_size;
+	if (*size == 0) return NULL;
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		die_errno("cannot open %s", file);
+	}
+	uint8_t *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		die_errno("cannot map %s", file);
+	}
+	close(fd);
+	*mapped = true;
+	return map;
+}
+
+static int fat_file(const char *file) {
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+	size_t size;
+	bool mapped;
+	fat_disk_t d;
+
+	uint8_t *image = fat_image(file, &size, &mapped);
+	if (image == NULL || fat_open(&d, image, size) < 0) {
+		fprintf(stderr, "%s: no FAT12 filesystem\n", file);
+		return 1;
+	}
+	if (args.fat_list) {
+		printf("%s:\n", file);
+	}
+	if (args.fat_dir != NULL) {
+		snprintf(path, sizeof(path), "%s", file);
+		snprintf(dir, sizeof(dir), "%s/%s", args.fat_dir,
+			basename(path));
+	}
+	int n = fat_walk(&d, args.fat_dir ? dir : NULL,
+			args.fat_list ? stdout : NULL);
+	if (args.verbose) {
+		fprintf(stderr, "%s: %d files\n", file, n);
+	}
+	fat_close(&d);
+	if (mapped) {
+		munmap(image, size);
+	} else {
+		free(image);
+	}
+	return 0;
+}
+
+/*
+ * --preview: a one-line look at each image from a few sampled tracks,
+ * reading at most args.budget bytes of it. The geometry comes from the
+ * options, the logdisk trailer, a FAT boot sector or the file size.
+ */
+typedef struct {
+	int fd;
+	size_t size;		// data size, without a logdisk trailer
+	size_t used;		// bytes read so far
+} preview_t;
+
+static const struct {
+	size_t size;
+	int cyls, heads, secs, len;
+} known_sizes[] = {
+	{ 163840, 40, 1, 8, 512 },	// PC 160K
+	{ 184320, 40, 1, 9, 512 },	// PC 180K
+	{ 204800, 40, 1, 10, 512 },	// Kaypro II
+	{ 256256, 77, 1, 26, 128 },	// 8" SSSD
+	{ 327680, 40, 2, 8, 512 },	// PC 320K
+	{ 368640, 40, 2, 9, 512 },	// PC 360K
+	{ 409600, 40, 2, 10, 512 },	// Kaypro 4
+	{ 737280, 80, 2, 9, 512 },	// PC 720K
+	{ 1228800, 80, 2, 15, 512 },	// PC 1.2M
+	{ 1474560, 80, 2, 18, 512 },	// PC 1.44M
+	{ 2949120, 80, 2, 36, 512 },	// PC 2.88M
+};
+
+// reads up to 'len' bytes at 'off', within the budget
+static size_t preview_read(preview_t *p, uint8_t *buf, size_t len,
+			off_t off) {
+	if (len > args.budget - p->used) len = args.budget - p->used;
+	if (off >= (off_t)p->size) return 0;
+	if (len > p->size - off) len = p->size - off;
+	ssize_t n = pread(p->fd, buf, len, off);
+	if (n < 0) return 0;
+	p->used += n;
+	return n;
+}
+
+static bool fat_boot(const uint8_t *b, size_t len, size_t size) {
+	if (len < 512) return false;
+	int bps = b[11] | (b[12] << 8);
+	int spc = b[13];
+	int spt = b[24] | (b[25] << 8);
+	int heads = b[26] | (b[27] << 8);
+	size_t total = b[19] | (b[20] << 8);
+	return bps == 512 && spc != 0 && (spc & (spc - 1)) == 0 &&
+		b[14] != 0 && (b[16] == 1 || b[16] == 2) && b[21] >= 0xf0 &&
+		spt > 0 && spt <= MAX_SECS && heads > 0 &&
+		heads <= MAX_HEADS && total * bps == size &&
+		total % (spt * heads) == 0;
+}
+
+// FAT directory entries: 8.3 names, sane attributes, up to a 0x00 end
+static bool fat_dir_like(const uint8_t *b, size_t len) {
+	int good = 0;
+	for (size_t i = 0; i + 32 <= len; i += 32) {
+		const uint8_t *e = b + i;
+		if (e[0] == 0x00) break;	// no more entries
+		if (e[0] == 0xe5) continue;	// deleted
+		if (e[11] == 0x0f) continue;	// long name part
+		if (e[11] & 0xc0) return false;
+		for (int j = 0; j < 11; ++j) {
+			int c = (j == 0 && e[0] == 0x05) ? 0xe5 : e[j];
+			if (c < ' ' || (c >= 'a' && c <= 'z') ||
+					strchr("\"*+,./:;<=>?[\\]|", c) != NULL) {
+				return false;
+			}
+		}
+		if (e[0] == ' ') return false;
+		++good;
+	}
+	return good > 0;
+}
+
+static bool cpm_dir_like(const uint8_t *b, size_t len) {
+	int good = 0;
+	for (size_t i = 0; i + 32 <= len; i += 32) {
+		const uint8_t *e = b + i;
+		if (e[0] == 0xe5 || e[0] == 0x20 || e[0] == 0x21) continue;
+		if (e[0] > 15) return false;
+		for (int j = 1; j < 12; ++j) {
+			int c = e[j] & 0x7f;
+			if (c < ' ' || c == 0x7f || (c >= 'a' && c <= 'z')) {
+				return false;
+			}
+		}
+		++good;
+	}
+	return good > 0;
+}
+
+static const char *classify(const uint8_t *b, size_t len, int seclen) {
+	if (len == 0) return "-";
+	bool blank = true;
+	for (size_t i = 0; i + seclen <= len && blank; i += seclen) {
+		blank = uniform(b + i, seclen);
+	}
+	if (blank) return "blank";
+	if (cpm_dir_like(b, len)) return "cpm-dir";
+	size_t text = 0;
+	uint32_t count[256] = { 0 };
+	for (size_t i = 0; i < len; ++i) {
+		uint8_t c = b[i];
+		++count[c];
+		if ((c >= ' ' && c < 0x7f) || c == '\r' || c == '\n' ||
+				c == '\t' || c == 0x1a) {
+			++text;
+		}
+	}
+	if (text * 10 >= len * 9) return "text";
+	double h = 0;
+	for (int c = 0; c < 256; ++c) {
+		if (count[c] == 0) continue;
+		double q = (double)count[c] / len;
+		h -= q * log2(q);
+	}
+	return h > 7.5 ? "data" : "code";
+}
+
+static const char *preview_geometry(preview_t *p, const char *file,
+			const uint8_t *boot, size_t blen) {
+	if (args.logdisk || args.cylinders > 0) {
+		return setup_geometry() < 0 ? NULL : "given";
+	}
+	if (fat_boot(boot, blen, p->size)) {
+		// fat_boot() checked these are non-zero and divide the total
+		args.length = 512;
+		args.sectors = boot[24] | (boot[25] << 8);
+		args.heads = boot[26] | (boot[27] << 8);
+		args.cylinders = ((boot[19] | (boot[20] << 8)) /
+				(args.sectors * args.heads));
+		return setup_geometry() < 0 ? NULL : "bpb";
+	}
+	for (int i = 0; i < sizeof(known_sizes) / sizeof(known_sizes[0]);
+			++i) {
+		if (known_sizes[i].size != p->size) continue;
+		args.cylinders = known_sizes[i].cyls;
+		args.heads = known_sizes[i].heads;
+		args.sectors = known_sizes[i].secs;
+		args.length = known_sizes[i].len;
+		return setup_geometry() < 0 ? NULL : "size";
+	}
+	// finally a logdisk trailer, if it fits the rest of the file
+	if (snoop_media(file) == 0 && args.cylinders > 0 && args.heads > 0 &&
+			args.sectors > 0 && args.length > 0 &&
+			(size_t)args.cylinders * args.heads * args.sectors *
+			args.length == p->size - 128 && setup_geometry() == 0) {
+		p->size -= 128;
+		return "logdisk";
+	}
+	return NULL;
+}
+
+static int preview_file(const char *file) {
+	struct stat stb;
+	preview_t p;
+	uint8_t *buf = malloc(args.budget + 1);
+	if (buf == NULL) {
+		die("out of memory");
+	}
+	memset(&p, 0, sizeof(p));
+	args.image_filename = file;
+	p.fd = open(file, O_RDONLY);
+	if (p.fd < 0 || fstat(p.fd, &stb) < 0) {
+		die_errno("cannot open %s", file);
+	}
+	p.size = stb.st_size;
+	if (args.logdisk && p.size >= 128) {
+		p.size -= 128;
+	}
+
+	// the first sector tells IMD files apart and may hold a BPB
+	size_t n0 = preview_read(&p, buf, 512, 0);
+	if (n0 >= 4 && memcmp(buf, "IMD ", 4) == 0) {
+		buf[n0] = '\0';
+		buf[strcspn((char *)buf, "\r\n\x1a")] = '\0';
+		printf("%s: IMD image, %s\n", file, buf);
+		close(p.fd);
+		free(buf);
+		return 0;
+	}
+	const char *src = preview_geometry(&p, file, buf, n0);
+	if (src == NULL) {
+		printf("%s: %zu bytes, unknown geometry\n", file, p.size);
+		close(p.fd);
+		free(buf);
+		return 1;
+	}
+
+	// each sampled track gets a third of the budget
+	size_t tsize = (size_t)args.sectors * args.length;
+	size_t share = args.budget / 3 / args.length * args.length;
+	if (share < (size_t)args.length) share = args.length;
+	if (share > tsize) share = tsize;
+	if (n0 < share) {
+		n0 += preview_read(&p, buf + n0, share - n0, n0);
+	}
+	if (n0 > share) n0 = share;
+	const char *t0 = classify(buf, n0 / args.length * args.length,
+			args.length);
+	const char *fs = "-";
+	if (fat_boot(buf, n0, p.size)) fs = "fat12";
+
+	// directory: the FAT root, or the first data track for CP/M
+	const char *dir = "-";
+	if (strcmp(fs, "fat12") == 0) {
+		size_t root = ((buf[14] | (buf[15] << 8)) +
+				buf[16] * (buf[22] | (buf[23] << 8))) * 512;
+		size_t n = preview_read(&p, buf, 512, root);
+		dir = fat_dir_like(buf, n) ? "fat-dir" : "-";
+	} else {
+		int offs[2] = { 2, 1 };
+		int noffs = 2;
+		if (args.dpb_off >= 0) {
+			offs[0] = args.dpb_off;
+			noffs = 1;
+		}
+		for (int i = 0; i < noffs && strcmp(dir, "cpm-dir") != 0; ++i) {
+			int cyl = offs[i] / args.heads;
+			int hd = offs[i] % args.heads;
+			if (args.policy == 0) {
+				cyl = offs[i] % args.cylinders;
+				hd = offs[i] / args.cylinders;
+			}
+			// just the first sector: whatever the logical
+			// skew, it is the start of the directory
+			size_t n = preview_read(&p, buf, args.length,
+					track_offset(cyl, hd));
+			dir = classify(buf, n / args.length * args.length,
+					args.length);
+		}
+		if (strcmp(dir, "cpm-dir") == 0) fs = "cp/m";
+	}
+
+	// last track
+	int lc = args.cylinders - 1;
+	int lh = args.heads - 1;
+	size_t n = preview_read(&p, buf, share, track_offset(lc, lh));
+	const char *last = classify(buf, n / args.length * args.length,
+			args.length);
+
+	printf("%s: %d/%d/%dx%d (%s) track0 %s dir %s last %s fs %s, "
+		"read %zu\n", file, args.cylinders, args.heads, args.sectors,
+		args.length, src, t0, dir, last, fs, p.used);
+	close(p.fd);
+	free(buf);
+	return 0;
+}
+
+/*
+ * --dry-run: the exact size of the IMD that converting each file would
+ * write, found by scanning the mapped sector data for uniform
+ * (compressed) sectors. Mirrors process_raw(): the comment and its
+ * terminator, then per selected track a 5-byte header, the sector map,
+ * a head map if logical heads differ (-p 2, side 1), and per sector
+ * 2 bytes if compressed, else 1 + length. Short images (-f) are
+ * zero-filled, as read_track() does.
+ */
+static bool padded_uniform(const uint8_t *map, size_t size, off_t off) {
+	if (off >= (off_t)size) return true;
+	size_t n = size - off;
+	if (n >= (size_t)args.length) {
+		return uniform(map + off, args.length);
+	}
+	return map[off] == 0 && uniform(map + off, n);
+}
+
+/*
+ * --reskew: rewrites IMD files in place with the physical skew of
+ * -k/-K and, if -o/-O are given, renumbered sectors. Within a track,
+ * the sectors in numbered order stand in for the raw file's sectors:
+ * the s-th lowest moves to slot tbl[s] of mkskew() and, if
+ * renumbering, becomes sector s + offset, as process_raw() would have
+ * written it. Sector records (compressed or not) and any cylinder and
+ * head maps move with their sectors, byte for byte.
+ */
+static const uint8_t *reskew_smap;
+
+static int cmp_smap(const void *a, const void *b) {
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	if (reskew_smap[x] != reskew_smap[y]) {
+		return reskew_smap[x] - reskew_smap[y];
+	}
+	return x - y;
+}
+
+static const int *reskew_table(int hd, int n) {
+	static int *tbl[2][MAX_SECS + 1];
+	int skew = (hd > 0 && abs(args.skew2) > 1) ? args.skew2 : args.skew;
+	hd = hd > 0 && abs(args.skew2) > 1;
+	if (tbl[hd][n] == NULL) {
+		tbl[hd][n] = malloc(n * sizeof(int));
+		if (tbl[hd][n] == NULL) {
+			die("out of memory");
+		}
+		if (abs(skew) > 1) {
+			int *t = mkskew(skew, n);
+			memcpy(tbl[hd][n], t, n * sizeof(int));
+			free(t);
+		} else {
+			for (int s = 0; s < n; ++s) tbl[hd][n][s] = s;
+		}
+	}
+	return tbl[hd][n];
+}
+
+static void reskew_track(const imd_track_t *t, FILE *out) {
+	int n = t->num_sectors;
+	int order[MAX_SECS], slot[MAX_SECS], rank[MAX_SECS];
+	uint8_t map[MAX_SECS];
+
+	for (int i = 0; i < n; ++i) order[i] = i;
+	reskew_smap = t->smap;
+	qsort(order, n, sizeof(*order), cmp_smap);
+	const int *tbl = reskew_table(t->head, n);
+	for (int s = 0; s < n; ++s) {
+		slot[tbl[s]] = order[s];
+		rank[tbl[s]] = s;
+	}
+
+	fwrite(t->start, 1, 5, out);
+	int off = t->head > 0 ? args.offset2 : args.offset1;
+	for (int j = 0; j < n; ++j) {
+		map[j] = off < 0 ? t->smap[slot[j]] : rank[j] + off;
+	}
+	fwrite(map, 1, n, out);
+	const uint8_t *maps[2] = { t->cmap, t->hmap };
+	for (int m = 0; m < 2; ++m) {
+		if (maps[m] == NULL) continue;
+		for (int j = 0; j < n; ++j) map[j] = maps[m][slot[j]];
+		fwrite(map, 1, n, out);
+	}
+	const uint8_t *end = t->start + t->len;
+	for (int j = 0; j < n; ++j) {
+		int i = slot[j];
+		fwrite(t->rec[i], 1, (i + 1 < n ? t->rec[i + 1] : end) -
+			t->rec[i], out);
+	}
+}
+
+static int reskew_file(const char *file) {
+	imd_file_t imd;
+	imd_track_t t;
+	char tmp[PATH_MAX + 16];
+
+	imd_open(&imd, file);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+	int fd = create_temp(tmp);
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, imd.len);	// same size
+	FILE *out = fdopen(fd, "wb");
+	if (out == NULL) {
+		die_errno("cannot open %s", tmp);
+	}
+	fwrite(imd.buf, 1, imd.comment_len + 1, out);
+	while (imd_next_track(&imd, &t)) {
+		int last = (t.head > 0 ? args.offset2 : args.offset1) +
+			t.num_sectors - 1;
+		if (t.num_sectors > MAX_SECS || last > 255) {
+			die("%s: cannot renumber cyl %d head %d", file,
+				t.cyl, t.head);
+		}
+		reskew_track(&t, out);
+	}
+	if (fclose(out) != 0) {
+		die_errno("cannot write %s", tmp);
+	}
+	imd_close(&imd);
+	commit_temp(tmp, file);
+	return 0;
+}
+
+static int dry_run_file(const char *file) {
+	size_t size;
+	disk_t disk;
+
+	const uint8_t *map = map_raw(file, &size);
+	size_t cap = (size_t)args.cylinders * args.heads * args.sectors *
+		args.length;
+	if (!args.ignore && size > cap) {
+		die("image file too large: %s", file);
+	}
+	if (!args.force && size < cap) {
+		die("image file too small: %s", file);
+	}
+
+	init_disk(&disk);
+	make_comment(&disk);
+	off_t imd = disk.comment_len + 1;
+	free_disk(&disk);
+
+	long tracks = 0, sectors = 0, compressed = 0;
+	int cyl_hi = last_cyl(args.cylinders);
+	for (int cyl = args.cyl_lo; cyl <= cyl_hi; cyl++) {
+		for (int hd = 0; hd < args.heads; hd++) {
+			if (!selected(cyl, hd)) continue;
+			imd += 5 + args.sectors;
+			if (args.policy == 2 && hd != 0) {
+				imd += args.sectors;	// head map
+			}
+			off_t off = track_offset(cyl, hd);
+			for (int s = 0; s < args.sectors; ++s) {
+				if (padded_uniform(map, size, off)) {
+					imd += 2;
+					++compressed;
+				} else {
+					imd += 1 + args.length;
+				}
+				off += args.length;
+			}
+			++tracks;
+			sectors += args.sectors;
+		}
+	}
+	if (map != NULL) munmap((void *)map, size);
+
+	off_t raw = (off_t)sectors * args.length;
+	printf("%s: %jd bytes, %ld tracks, %ld sectors, %ld compressed "
+		"(%ld%%), %jd%% of %jd raw bytes\n", file, (intmax_t)imd,
+		tracks, sectors, compressed,
+		sectors ? compressed * 100 / sectors : 0,
+		(intmax_t)(raw ? imd * 100 / raw : 0), (intmax_t)raw);
+	return 0;
+}
+
+/*
+ * --grep: images are searched as one logical stream, tracks in
+ * cylinder/head order and the sectors of each track in logical order,
+ * so a match may span any number of sectors and tracks. Raw files use
+ * the same geometry, policy and numbering as conversion; IMD files are
+ * read through their sector maps. Hits are reported by the sector's
+ * logical cylinder and head, with the physical side if it differs.
+ */
+typedef struct {
+	int cyl;
+	int head;		// physical
+	int nsec;
+	int len;		// sector size
+	long start;		// offset in the window, < 0 if partly dropped
+	uint8_t secs[MAX_SECS];	// logical sector numbers, logical order
+	uint8_t lcyl[MAX_SECS];	// logical cylinder and head of each
+	uint8_t lhead[MAX_SECS];
+	int phys[MAX_SECS];	// physical slot, -1 if unknown
+} grep_track_t;
+
+typedef struct {
+	const char *file;
+	uint8_t *win;		// tail of earlier tracks + this track
+	size_t max;
+	size_t carry;
+	grep_track_t *trk;	// tracks with bytes in win, oldest first
+	int ntrk;
+	int maxtrk;
+	int hits;
+} grep_t;
+
+static uint8_t *grep_pat;
+static size_t grep_plen;
+
+// slot for the next track, filled in before grep_track()
+static grep_track_t *grep_next(grep_t *g) {
+	if (g->ntrk == g->maxtrk) {
+		g->maxtrk = g->maxtrk ? 2 * g->maxtrk : 4;
+		g->trk = realloc(g->trk, g->maxtrk * sizeof(*g->trk));
+		if (g->trk == NULL) {
+			die("out of memory");
+		}
+	}
+	return &g->trk[g->ntrk];
+}
+
+static void grep_report(grep_t *g, size_t w) {
+	const grep_track_t *t = g->trk;
+	while ((long)w >= t->start + (long)t->nsec * t->len) {
+		++t;
+	}
+	size_t off = w - t->start;
+	int s = off / t->len;
+	printf("%s: cyl %d head %d sector %d offset %zu", g->file,
+		t->lcyl[s], t->lhead[s], t->secs[s], off % t->len);
+	if (t->lhead[s] != t->head) {
+		printf(" side %d", t->head);
+	}
+	if (t->phys[s] >= 0) {
+		printf(" phys %d", t->phys[s]);
+	}
+	printf("\n");
+	++g->hits;
+}
+
+// searches 'data', the track in grep_next()'s slot, in logical order
+static void grep_track(grep_t *g, const uint8_t *data) {
+	grep_track_t *t = &g->trk[g->ntrk];
+	size_t tlen = (size_t)t->nsec * t->len;
+	if (tlen == 0) return;
+	++g->ntrk;
+	t->start = g->carry;
+	if (g->carry + tlen > g->max) {
+		g->max = g->carry + tlen;
+		g->win = realloc(g->win, g->max);
+		if (g->win == NULL) {
+			die("out of memory");
+		}
+	}
+	memcpy(g->win + g->carry, data, tlen);
+	size_t wlen = g->carry + tlen;
+	const uint8_t *p = g->win;
+	const uint8_t *end = g->win + wlen;
+	while ((p = memmem(p, end - p, grep_pat, grep_plen)) != NULL) {
+		grep_report(g, p - g->win);
+		++p;
+	}
+	/*
+	 * Keep the last grep_plen - 1 bytes, however many tracks they
+	 * come from: a match starting there has not been reported yet.
+	 */
+	size_t keep = grep_plen - 1;
+	if (keep > wlen) keep = wlen;
+	size_t drop = wlen - keep;
+	memmove(g->win, g->win + drop, keep);
+	g->carry = keep;
+	int gone = 0;
+	for (int i = 0; i < g->ntrk; ++i) {
+		t = &g->trk[i];
+		t->start -= drop;
+		if (t->start + (long)t->nsec * t->len <= 0) {
+			gone = i + 1;
+		}
+	}
+	g->ntrk -= gone;
+	memmove(g->trk, g->trk + gone, g->ntrk * sizeof(*g->trk));
+}
+
+static void grep_imd(grep_t *g) {
+	imd_file_t imd;
+	imd_track_t trk;
+	uint8_t *buf = NULL;
+
+	imd_open(&imd, g->file);
+	while (imd_next_track(&imd, &trk)) {
+		grep_track_t *t = grep_next(g);
+		int n = trk.num_sectors;
+		t->cyl = trk.cyl;
+		t->head = trk.head;
+		t->nsec = n;
+		t->len = trk.sector_size;
+		buf = realloc(buf, (size_t)n * t->len + 1);
+		if (buf == NULL) {
+			die("out of memory");
+		}
+		// logical order: insertion sort of slots by sector number
+		for (int i = 0; i < n; ++i) {
+			int j = i;
+			while (j > 0 && t->secs[j - 1] > trk.smap[i]) {
+				t->secs[j] = t->secs[j - 1];
+				t->phys[j] = t->phys[j - 1];
+				--j;
+			}
+			t->secs[j] = trk.smap[i];
+			t->phys[j] = i;
+		}
+		for (int i = 0; i < n; ++i) {
+			int ph = t->phys[i];
+			t->lcyl[i] = trk.cmap ? trk.cmap[ph] : trk.cyl;
+			t->lhead[i] = trk.hmap ? trk.hmap[ph] : trk.head;
+			imd_sector_data(&trk, ph, buf + i * t->len);
+		}
+		grep_track(g, buf);
+	}
+	free(buf);
+	imd_close(&imd);
+}
+
+static void grep_raw(grep_t *g) {
+	size_t size;
+	const uint8_t *map = map_raw(g->file, &size);
+	if (map == NULL) return;
+	size_t tsize = (size_t)args.sectors * args.length;
+	for (int cyl = 0; cyl < args.cylinders; cyl++) {
+		for (int head = 0; head < args.heads; head++) {
+			size_t off = track_offset(cyl, head);
+			if (off + tsize > size) continue;
+			grep_track_t *t = grep_next(g);
+			int base = head ? args.offset2 : args.offset1;
+			t->cyl = cyl;
+			t->head = head;
+			t->nsec = args.sectors;
+			t->len = args.length;
+			for (int s = 0; s < args.sectors; ++s) {
+				t->secs[s] = base + s;
+				t->lcyl[s] = cyl;
+				// Kaypro: both sides are logical head 0
+				t->lhead[s] = args.policy == 2 ? 0 : head;
+				t->phys[s] = -1;
+				if (head > 0 && args.sectbl2 != NULL) {
+					t->phys[s] = args.sectbl2[s];
+				} else if (args.sectbl != NULL) {
+					t->phys[s] = args.sectbl[s];
+				}
+			}
+			grep_track(g, map + off);
+		}
+	}
+	munmap((void *)map, size);
+}
+
+static int grep_file(const char *file) {
+	grep_t g;
+	char magic[4];
+
+	memset(&g, 0, sizeof(g));
+	g.file = file;
+	FILE *f = fopen(file, "rb");
+	if (f == NULL) {
+		die_errno("cannot open %s", file);
+	}
+	size_t n = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+	if (n == sizeof(magic) && memcmp(magic, "IMD ", 4) == 0) {
+		grep_imd(&g);
+	} else {
+		grep_raw(&g);
+	}
+	free(g.win);
+	free(g.trk);
+	return g.hits == 0;	// a "failure", like grep(1)
+}
+
+/*
+ * Decodes C-style escapes in a search pattern: \\, \n, \r, \t, \xNN.
+ */
+static size_t unescape(const char *in, uint8_t *out) {
+	size_t n = 0;
+	while (*in) {
+		if (*in != '\\' || in[1] == '\0') {
+			out[n++] = *in++;
+			continue;
+		}
+		++in;
+		switch (*in) {
+		case 'n': out[n++] = '\n'; ++in; break;
+		case 'r': out[n++] = '\r'; ++in; break;
+		case 't': out[n++] = '\t'; ++in; break;
+		case 'x': {
+			char *end;
+			char hex[3] = { in[1], in[1] ? in[2] : 0, 0 };
+			out[n++] = strtoul(hex, &end, 16);
+			in += 1 + (end - hex);
+			break;
+		}
+		default: out[n++] = *in++; break;
+		}
+	}
+	return n;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: raw2imd [OPTION]... RAW-FILE [IMAGE-FILE]\n");
+	fprintf(stderr, "  -5		 RAW-FILE is 5.25\" diskette (default)\n");
+	fprintf(stderr, "  -8		 RAW-FILE is 8\" diskette\n");
+	fprintf(stderr, "  -c NUM	 number of cylinders\n");
+	fprintf(stderr, "  -h NUM	 number of heads (sides)\n");
+	fprintf(stderr, "  -s NUM	 number of sectors/track\n");
+	fprintf(stderr, "  -l NUM	 sector length\n");
+	fprintf(stderr, "  -m		 RAW-FILE is MFM (i.e. double density)\n");
+	fprintf(stderr, "  -r NUM	 override data rate [250,300,500]\n");
+	fprintf(stderr, "  -L		 RAW-FILE is logdisk format (has geom)\n");
+	fprintf(stderr, "  -o		 sector number offset (1)\n");
+	fprintf(stderr, "  -O		 side 1 sector number offset (-o)\n");
+	fprintf(stderr, "  -k NUM	 physical sector skew (1)\n");
+	fprintf(stderr, "  -K NUM	 side 1 physical skew (-k)\n");
+	fprintf(stderr, "  -i		 ignore excess data in RAW-FILE\n");
+	fprintf(stderr, "  -f		 force using smaller RAW-FILE\n");
+	fprintf(stderr, "  -C		 read comment from stdin\n");
+	fprintf(stderr, "  -T STR	 use STR as comment\n");
+	fprintf(stderr, "  -v		 verbose output (multiple)\n");
+	fprintf(stderr, "  --show-disk	 format -v output with dumpfloppy's\n"
+			"		 show_disk() (slower; same text)\n");
+	fprintf(stderr, "  --verify	 read back IMAGE-FILE and check it\n"
+			"		 against RAW-FILE\n");
+	fprintf(stderr, "  --manifest FILE write track/sector hashes to FILE\n"
+			"		 (JSON lines, \"-\" for stdout)\n");
+	fprintf(stderr, "  --report json|cbor write a per-track disk report to\n"
+			"		 stdout (JSON lines or CBOR sequence);\n"
+			"		 not with -v\n");
+	fprintf(stderr, "  --store DIR	 add the IMD to track-deduplicated store\n"
+			"		 DIR (IMAGE-FILE is optional)\n");
+	fprintf(stderr, "  --fingerprint FILE append near-duplicate signature\n"
+			"		 to FILE (\"-\" for stdout)\n");
+	fprintf(stderr, "  --delta BASE	 write IMAGE-FILE as a delta against\n"
+			"		 IMD file BASE\n");
+	fprintf(stderr, "  --archive ARCH	 add the IMD to archive ARCH.pack/.cat\n"
+			"		 (IMAGE-FILE is optional)\n");
+	fprintf(stderr, "  --trigrams FILE	 write sector trigram index to FILE\n");
+	fprintf(stderr, "  --cyl A[-B]	 only convert cylinders A to B\n");
+	fprintf(stderr, "  --head H	 only convert head H\n");
+	fprintf(stderr, "  --durability none|batch|each\n"
+			"		 sync outputs to disk: not at all, once per\n"
+			"		 group of --batch outputs, or each output\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --batch OUTDIR FILE|DIR...\n");
+	fprintf(stderr, "		 convert each FILE and each file under DIR\n"
+			"		 to OUTDIR/NAME.imd, skipping outputs that\n"
+			"		 are up to date\n");
+	fprintf(stderr, "  --cache-hash	 also treat inputs with unchanged content\n"
+			"		 as up to date\n");
+	fprintf(stderr, "  --resume	 skip work done by an interrupted batch\n");
+	fprintf(stderr, "  --files-from LIST also convert each FILE or DIR listed\n"
+			"		 in LIST, one per line (\"-\": stdin)\n");
+	fprintf(stderr, "  --shard I/N	 only convert part I of N, split by path\n"
+			"		 hash and size (for N cooperating runs)\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --grep PATTERN FILE...\n");
+	fprintf(stderr, "		 find PATTERN (\\xNN escapes) in raw or IMD\n"
+			"		 files, reporting logical cyl/head/sector\n"
+			"		 and offset (and the side if it differs);\n"
+			"		 exit status 1 if nothing matched\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --cpm DIR FILE...\n");
+	fprintf(stderr, "		 extract CP/M files of each raw FILE into\n"
+			"		 DIR/FILE/ (user N in DIR/FILE/uN/)\n");
+	fprintf(stderr, "  --dpb BLS,DIR,OFF CP/M block size, directory entries\n"
+			"		 and reserved tracks (guessed)\n");
+	fprintf(stderr, "  --lskew NUM	 CP/M logical sector skew (logdisk 'l')\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --reraw OUT RAW-FILE\n");
+	fprintf(stderr, "		 rewrite RAW-FILE in another raw layout\n"
+			"		 (OUT may be RAW-FILE: done in place)\n");
+	fprintf(stderr, "  --layout P[,phys|,cpm] OUT's 2-side policy (-p) and\n"
+			"		 sector order (phys: skewed per -k/-K,\n"
+			"		 cpm: CP/M logical order per --lskew)\n");
+	fprintf(stderr, "  --phys		 RAW-FILE sectors are in physical order\n");
+	fprintf(stderr, "  --cpm-order	 RAW-FILE sectors are in CP/M logical order\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --preview FILE...\n");
+	fprintf(stderr, "		 one-line summary of each image from its\n"
+			"		 boot, directory and last tracks\n");
+	fprintf(stderr, "  --budget BYTES	 read at most BYTES per file (65536)\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --dry-run FILE...\n");
+	fprintf(stderr, "		 print the exact size of the IMD each raw\n"
+			"		 FILE would convert to, and how many of its\n"
+			"		 sectors compress\n");
+	fprintf(stderr, "usage: raw2imd [-k NUM] [-K NUM] [-o NUM] [-O NUM] "
+			"--reskew IMD-FILE...\n");
+	fprintf(stderr, "		 rewrite each IMD-FILE in place with physical\n"
+			"		 skew -k/-K and, given -o/-O, renumbered\n"
+			"		 sectors\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --guess-skew FILE...\n");
+	fprintf(stderr, "		 find the CP/M logical skew (--lskew) under\n"
+			"		 which each raw FILE reads most coherently\n");
+	fprintf(stderr, "usage: raw2imd [OPTION]... --fat DIR|--fatls FILE...\n");
+	fprintf(stderr, "		 extract (or list) the FAT12 files of each\n"
+			"		 raw or IMD FILE into DIR/FILE/; raw files\n"
+			"		 are taken as interlaced unless -L or -c\n");
+	fprintf(stderr, "  -j NUM	 parallel jobs for multi-file modes\n"
+			"		 (number of CPUs)\n");
+	fprintf(stderr, "usage: raw2imd --restore DIR NAME IMAGE-FILE\n");
+	fprintf(stderr, "		 rebuild IMD NAME from store DIR\n");
+	fprintf(stderr, "usage: raw2imd --fpindex [--similarity PCT] "
+			"SIG-FILE...\n");
+	fprintf(stderr, "		 group near-duplicate images (PCT: 50)\n");
+	fprintf(stderr, "usage: raw2imd --undelta BASE [--flat] DELTA OUT-FILE\n");
+	fprintf(stderr, "		 rebuild IMD (or flat image) from DELTA\n");
+	fprintf(stderr, "usage: raw2imd --lookup ARCH [-c NUM] [-h NUM] [-s NUM] "
+			"[-l NUM]\n"
+			"		 [-T GLOB] [--hash HEX] [NAME-GLOB]\n");
+	fprintf(stderr, "		 list archived images matching geometry,\n"
+			"		 title, image hash and name\n");
+	fprintf(stderr, "usage: raw2imd --extract ARCH NAME IMAGE-FILE\n");
+	fprintf(stderr, "usage: raw2imd --tgmerge OUT INDEX...\n");
+	fprintf(stderr, "usage: raw2imd --tgquery STRING INDEX...\n");
+	fprintf(stderr, "		 list sectors (image cyl head sector)\n"
+			"		 that may contain STRING\n");
+}
+
+enum {
+	OPT_VERIFY = 256,
+	OPT_MANIFEST,
+	OPT_STORE,
+	OPT_RESTORE,
+	OPT_FINGERPRINT,
+	OPT_FPINDEX,
+	OPT_SIMILARITY,
+	OPT_DELTA,
+	OPT_UNDELTA,
+	OPT_FLAT,
+	OPT_ARCHIVE,
+	OPT_LOOKUP,
+	OPT_HASH,
+	OPT_EXTRACT,
+	OPT_TRIGRAMS,
+	OPT_TGMERGE,
+	OPT_TGQUERY,
+	OPT_GREP,
+	OPT_CPM,
+	OPT_DPB,
+	OPT_LSKEW,
+	OPT_FAT,
+	OPT_FATLS,
+	OPT_GUESS_SKEW,
+	OPT_RERAW,
+	OPT_LAYOUT,
+	OPT_PHYS,
+	OPT_CPM_ORDER,
+	OPT_CYL,
+	OPT_HEAD,
+	OPT_PREVIEW,
+	OPT_DRY_RUN,
+	OPT_SHOW_DISK,
+	OPT_RESKEW,
+	OPT_BUDGET,
+	OPT_REPORT,
+	OPT_BATCH,
+	OPT_CACHE_HASH,
+	OPT_RESUME,
+	OPT_DURABILITY,
+	OPT_FILES_FROM,
+	OPT_SHARD,
+};
+
+static const struct option long_opts[] = {
+	{ "verify", no_argument, NULL, OPT_VERIFY },
+	{ "manifest", required_argument, NULL, OPT_MANIFEST },
+	{ "store", required_argument, NULL, OPT_STORE },
+	{ "restore", required_argument, NULL, OPT_RESTORE },
+	{ "fingerprint", required_argument, NULL, OPT_FINGERPRINT },
+	{ "fpindex", no_argument, NULL, OPT_FPINDEX },
+	{ "similarity", required_argument, NULL, OPT_SIMILARITY },
+	{ "delta", required_argument, NULL, OPT_DELTA },
+	{ "undelta", required_argument, NULL, OPT_UNDELTA },
+	{ "flat", no_argument, NULL, OPT_FLAT },
+	{ "archive", required_argument, NULL, OPT_ARCHIVE },
+	{ "lookup", required_argument, NULL, OPT_LOOKUP },
+	{ "hash", required_argument, NULL, OPT_HASH },
+	{ "extract", required_argument, NULL, OPT_EXTRACT },
+	{ "trigrams", required_argument, NULL, OPT_TRIGRAMS },
+	{ "tgmerge", required_argument, NULL, OPT_TGMERGE },
+	{ "tgquery", required_argument, NULL, OPT_TGQUERY },
+	{ "grep", required_argument, NULL, OPT_GREP },
+	{ "cpm", required_argument, NULL, OPT_CPM },
+	{ "dpb", required_argument, NULL, OPT_DPB },
+	{ "lskew", required_argument, NULL, OPT_LSKEW },
+	{ "fat", required_argument, NULL, OPT_FAT },
+	{ "fatls", no_argument, NULL, OPT_FATLS },
+	{ "guess-skew", no_argument, NULL, OPT_GUESS_SKEW },
+	{ "reraw", required_argument, NULL, OPT_RERAW },
+	{ "layout", required_argument, NULL, OPT_LAYOUT },
+	{ "phys", no_argument, NULL, OPT_PHYS },
+	{ "cpm-order", no_argument, NULL, OPT_CPM_ORDER },
+	{ "cyl", required_argument, NULL, OPT_CYL },
+	{ "head", required_argument, NULL, OPT_HEAD },
+	{ "preview", no_argument, NULL, OPT_PREVIEW },
+	{ "dry-run", no_argument, NULL, OPT_DRY_RUN },
+	{ "show-disk", no_argument, NULL, OPT_SHOW_DISK },
+	{ "reskew", no_argument, NULL, OPT_RESKEW },
+	{ "budget", required_argument, NULL, OPT_BUDGET },
+	{ "report", required_argument, NULL, OPT_REPORT },
+	{ "batch", required_argument, NULL, OPT_BATCH },
+	{ "cache-hash", no_argument, NULL, OPT_CACHE_HASH },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "durability", required_argument, NULL, OPT_DURABILITY },
+	{ "files-from", required_argument, NULL, OPT_FILES_FROM },
+	{ "shard", required_argument, NULL, OPT_SHARD },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char **argv) {
 	int x;
-	int skew = -1;
-	int skew2 = -1;
-	int data_rate = -1;
+	const char *restore = NULL;
+	bool fpindex = false;
+	int similarity = 50;
+	const char *undelta = NULL;
+	bool flat = false;
+	const char *lookup = NULL;
+	const char *extract = NULL;
+	const char *hash = NULL;
+	const char *tgmerge = NULL;
+	const char *tgquery = NULL;
+	const char *grep = NULL;
 
 	dev_fd = -1;
 	args.cylinders = -1;
@@ -401,19 +3114,63 @@ int main(int argc, char **argv) {
 	args.mfm = 0;	// need numeric values 0/1
 	args.dmode = -1; // index into DATA_MODES[]
 	args.policy = 1; // default to "interlaced"
+	args.skew = -1;
+	args.skew2 = -1;
+	args.data_rate = -1;
 	args.sectbl = NULL;
 	args.sectbl2 = NULL;
 	args.force = false;
 	args.ignore = false;
 	args.read_comment = false;
+	args.comment = NULL;
+	args.comment_len = 0;
 	args.title = NULL;
 	args.imd_filename = NULL;
 	args.image_filename = NULL;
 	args.logdisk = false;
 	args.verbose = 0;
+	args.verify = false;
+	args.manifest = NULL;
+	args.report = NULL;
+	args.store = NULL;
+	args.fingerprint = NULL;
+	args.delta = NULL;
+	args.archive = NULL;
+	args.trigrams = NULL;
+	args.jobs = default_jobs();
+	args.lskew = 0;
+	args.lskew_set = false;
+	args.cpm_dir = NULL;
+	args.dpb_bls = 0;
+	args.dpb_dirents = 0;
+	args.dpb_off = -1;
+	args.fat_dir = NULL;
+	args.fat_list = false;
+	args.guess_skew = false;
+	args.nfiles = 0;
+	args.reraw = NULL;
+	args.out_policy = -1;
+	args.out_order = ORDER_LOGICAL;
+	args.in_order = ORDER_LOGICAL;
+	args.cyl_lo = 0;
+	args.cyl_hi = -1;
+	args.head = -1;
+	args.preview = false;
+	args.dry_run = false;
+	args.show_disk = false;
+	args.reskew = false;
+	args.budget = 64 * 1024;
+	args.batch = NULL;
+	args.cache_hash = false;
+	args.resume = false;
+	args.durability = DURABLE_NONE;
+	args.files_from = NULL;
+	args.shard = 0;
+	args.shards = 0;
 
 	while (true) {
-		int opt = getopt(argc, argv, "58p:c:h:s:l:o:O:mr:ifCT:Lk:K:v");
+		int opt = getopt_long(argc, argv,
+				"58p:c:h:s:l:o:O:mr:ifCT:Lk:K:vj:", long_opts, NULL);
 		if (opt == -1) break;
 
 		switch (opt) {
@@ -448,9 +3205,10 @@ int main(int argc, char **argv) {
 			args.mfm = 1;
 			break;
 		case 'r':	// data rate (250/300/500kbps)
-			data_rate = atoi(optarg);
-			if (data_rate != 250 && data_rate != 300 &&
-					data_rate != 500 && data_rate != 1000) {
+			args.data_rate = atoi(optarg);
+			if (args.data_rate != 250 && args.data_rate != 300 &&
+					args.data_rate != 500 &&
+					args.data_rate != 1000) {
 				goto error;
 			}
 			break;
@@ -470,14 +3228,192 @@ int main(int argc, char **argv) {
 			args.logdisk = true;
 			break;
 		case 'k':
-			skew = atoi(optarg);
+			args.skew = atoi(optarg);
 			break;
 		case 'K':
-			skew2 = atoi(optarg);
+			args.skew2 = atoi(optarg);
 			break;
 		case 'v':
 			++args.verbose;
 			break;
+		case OPT_VERIFY:
+			args.verify = true;
+			break;
+		case OPT_MANIFEST:
+			args.manifest = optarg;
+			break;
+		case OPT_REPORT:
+			if (strcmp(optarg, "json") != 0 &&
+					strcmp(optarg, "cbor") != 0) {
+				goto error;
+			}
+			args.report = optarg;
+			break;
+		case OPT_STORE:
+			args.store = optarg;
+			break;
+		case OPT_RESTORE:
+			restore = optarg;
+			break;
+		case OPT_FINGERPRINT:
+			args.fingerprint = optarg;
+			break;
+		case OPT_FPINDEX:
+			fpindex = true;
+			break;
+		case OPT_SIMILARITY:
+			similarity = atoi(optarg);
+			break;
+		case OPT_DELTA:
+			args.delta = optarg;
+			break;
+		case OPT_UNDELTA:
+			undelta = optarg;
+			break;
+		case OPT_FLAT:
+			flat = true;
+			break;
+		case OPT_ARCHIVE:
+			args.archive = optarg;
+			break;
+		case OPT_LOOKUP:
+			lookup = optarg;
+			break;
+		case OPT_HASH:
+			hash = optarg;
+			break;
+		case OPT_EXTRACT:
+			extract = optarg;
+			break;
+		case OPT_TRIGRAMS:
+			args.trigrams = optarg;
+			break;
+		case OPT_TGMERGE:
+			tgmerge = optarg;
+			break;
+		case OPT_TGQUERY:
+			tgquery = optarg;
+			break;
+		case OPT_GREP:
+			grep = optarg;
+			break;
+		case 'j':
+			args.jobs = atoi(optarg);
+			break;
+		case OPT_CPM:
+			args.cpm_dir = optarg;
+			break;
+		case OPT_DPB:
+			if (sscanf(optarg, "%d,%d,%d", &args.dpb_bls,
+					&args.dpb_dirents, &args.dpb_off) != 3) {
+				goto error;
+			}
+			break;
+		case OPT_LSKEW:
+			args.lskew = atoi(optarg);
+			args.lskew_set = true;
+			break;
+		case OPT_FAT:
+			args.fat_dir = optarg;
+			break;
+		case OPT_FATLS:
+			args.fat_list = true;
+			break;
+		case OPT_GUESS_SKEW:
+			args.guess_skew = true;
+			break;
+		case OPT_RERAW:
+			args.reraw = optarg;
+			break;
+		case OPT_LAYOUT: {
+			char *end;
+			args.out_policy = strtol(optarg, &end, 10);
+			if (end == optarg || args.out_policy < 0 ||
+					args.out_policy > 2) {
+				goto error;
+			}
+			if (strcmp(end, ",phys") == 0) {
+				args.out_order = ORDER_PHYS;
+			} else if (strcmp(end, ",cpm") == 0) {
+				args.out_order = ORDER_CPM;
+			} else if (*end != '\0') {
+				goto error;
+			}
+			break;
+		}
+		case OPT_PHYS:
+			args.in_order = ORDER_PHYS;
+			break;
+		case OPT_CPM_ORDER:
+			args.in_order = ORDER_CPM;
+			break;
+		case OPT_CYL: {
+			char *end;
+			args.cyl_lo = strtol(optarg, &end, 10);
+			args.cyl_hi = args.cyl_lo;
+			if (*end == '-') {
+				args.cyl_hi = strtol(end + 1, &end, 10);
+			}
+			if (end == optarg || *end != '\0' || args.cyl_lo < 0 ||
+					args.cyl_hi < args.cyl_lo) {
+				goto error;
+			}
+			break;
+		}
+		case OPT_HEAD:
+			args.head = atoi(optarg);
+			if (args.head < 0) {
+				goto error;
+			}
+			break;
+		case OPT_PREVIEW:
+			args.preview = true;
+			break;
+		case OPT_DRY_RUN:
+			args.dry_run = true;
+			break;
+		case OPT_SHOW_DISK:
+			args.show_disk = true;
+			break;
+		case OPT_RESKEW:
+			args.reskew = true;
+			break;
+		case OPT_BATCH:
+			args.batch = optarg;
+			break;
+		case OPT_CACHE_HASH:
+			args.cache_hash = true;
+			break;
+		case OPT_RESUME:
+			args.resume = true;
+			break;
+		case OPT_FILES_FROM:
+			args.files_from = optarg;
+			break;
+		case OPT_SHARD:
+			if (sscanf(optarg, "%d/%d", &args.shard,
+					&args.shards) != 2 || args.shards < 1 ||
+					args.shard < 1 || args.shard > args.shards) {
+				goto error;
+			}
+			break;
+		case OPT_DURABILITY:
+			if (strcmp(optarg, "none") == 0) {
+				args.durability = DURABLE_NONE;
+			} else if (strcmp(optarg, "batch") == 0) {
+				args.durability = DURABLE_BATCH;
+			} else if (strcmp(optarg, "each") == 0) {
+				args.durability = DURABLE_EACH;
+			} else {
+				goto error;
+			}
+			break;
+		case OPT_BUDGET:
+			args.budget = strtoul(optarg, NULL, 0);
+			if (args.budget < 512) {
+				goto error;
+			}
+			break;
 		default:
 error:
 			usage();
@@ -486,6 +3422,171 @@ error:
 	}
 
 	x = optind;
+	if (args.report != NULL && (args.verbose ||
+			(args.manifest != NULL && strcmp(args.manifest, "-") == 0) ||
+			(args.fingerprint != NULL &&
+			strcmp(args.fingerprint, "-") == 0))) {
+		// the report would be mixed with other output on stdout
+		fprintf(stderr, "--report writes to stdout: it cannot be used "
+			"with -v or another output to \"-\"\n");
+		return 1;
+	}
+	if (args.verbose > 1 && !isatty(1)) {
+		// -vv sector dumps are large: write them out in big pieces
+		setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+	}
+	if (restore != NULL) {
+		if (x + 2 != argc) {
+			usage();
+			return 1;
+		}
+		restore_imd(restore, argv[x], argv[x + 1]);
+		return 0;
+	}
+	if (lookup != NULL) {
+		cat_query_t q;
+		q.cylinders = args.cylinders;
+		q.heads = args.heads;
+		q.sectors = args.sectors;
+		q.sector_len = args.length;
+		q.title = args.title;
+		q.name = (x < argc) ? argv[x] : NULL;
+		q.match_hash = (hash != NULL);
+		q.hash = hash ? strtoull(hash, NULL, 16) : 0;
+		return archive_lookup(lookup, &q, stdout) ? 0 : 1;
+	}
+	if (grep != NULL) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		grep_pat = malloc(strlen(grep) + 1);
+		if (grep_pat == NULL) {
+			die("out of memory");
+		}
+		grep_plen = unescape(grep, grep_pat);
+		if (grep_plen == 0) {
+			usage();
+			return 1;
+		}
+		// as grep(1): status 1 if no file matched
+		return run_jobs(argc - x, &argv[x], args.jobs, grep_file) ==
+				argc - x ? 1 : 0;
+	}
+	if (args.cpm_dir != NULL) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		if (mkdir(args.cpm_dir, 0777) < 0 && errno != EEXIST) {
+			die_errno("cannot create %s", args.cpm_dir);
+		}
+		return run_jobs(argc - x, &argv[x], args.jobs, cpm_file) ? 1 : 0;
+	}
+	if (args.reraw != NULL) {
+		if (x + 1 != argc) {
+			usage();
+			return 1;
+		}
+		args.image_filename = argv[x];
+		reraw();
+		return 0;
+	}
+	args.nfiles = argc - x;
+	if (args.batch != NULL) {
+		if (x == argc && args.files_from == NULL) {
+			usage();
+			return 1;
+		}
+		if (args.read_comment && args.files_from != NULL &&
+				strcmp(args.files_from, "-") == 0) {
+			fprintf(stderr, "-C and --files-from - both read stdin\n");
+			return 1;
+		}
+		return run_batch(argc - x, &argv[x]);
+	}
+	if (args.preview) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		return run_jobs(argc - x, &argv[x], args.jobs,
+				preview_file) ? 1 : 0;
+	}
+	if (args.reskew) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		if (args.offset2 < 0) args.offset2 = args.offset1;
+		return run_jobs(argc - x, &argv[x], args.jobs,
+				reskew_file) ? 1 : 0;
+	}
+	if (args.dry_run) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		if (args.read_comment) {
+			read_comment();	// not once per job
+		}
+		return run_jobs(argc - x, &argv[x], args.jobs,
+				dry_run_file) ? 1 : 0;
+	}
+	if (args.guess_skew) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		return run_jobs(argc - x, &argv[x], args.jobs,
+				guess_skew_file) ? 1 : 0;
+	}
+	if (args.fat_dir != NULL || args.fat_list) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		if (args.fat_dir != NULL && mkdir(args.fat_dir, 0777) < 0 &&
+				errno != EEXIST) {
+			die_errno("cannot create %s", args.fat_dir);
+		}
+		return run_jobs(argc - x, &argv[x], args.jobs, fat_file) ? 1 : 0;
+	}
+	if (tgmerge != NULL || tgquery != NULL) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		if (tgmerge != NULL) {
+			tg_merge(tgmerge, argc - x, &argv[x]);
+			return 0;
+		}
+		return tg_query(argc - x, &argv[x], tgquery, stdout) ? 0 : 1;
+	}
+	if (extract != NULL) {
+		if (x + 2 != argc) {
+			usage();
+			return 1;
+		}
+		archive_extract(extract, argv[x], argv[x + 1]);
+		return 0;
+	}
+	if (undelta != NULL) {
+		if (x + 2 != argc) {
+			usage();
+			return 1;
+		}
+		undelta_imd(undelta, argv[x], argv[x + 1], flat);
+		return 0;
+	}
+	if (fpindex) {
+		if (x == argc) {
+			usage();
+			return 1;
+		}
+		fp_index(argc - x, &argv[x], similarity, stdout);
+		return 0;
+	}
 	if (x == argc) {
 		// raw file missing - or no arguments
 		usage();
@@ -501,66 +3602,19 @@ error:
 		return 1;
 	}
 
-	if (args.logdisk) {
-		x = snoop_media(args.image_filename);
-		if (x < 0) {
-			perror(args.image_filename);
-			exit(1);
-		}
-	}
-	if (args.cylinders < 0 || args.heads < 0 ||
-			args.sectors < 0 || args.length < 0) {
-		usage();
+	int e = setup_geometry();
+	if (e < 0) {
+		if (e == -1) usage();
 		return 1;
 	}
-	switch (args.length) {
-	case 128: args.length_code = 0; break;
-	case 256: args.length_code = 1; break;
-	case 512: args.length_code = 2; break;
-	case 1024: args.length_code = 3; break;
-	default:
-		usage();
+	if (args.verify && args.imd_filename == NULL) {
+		fprintf(stderr, "--verify requires IMAGE-FILE\n");
 		return 1;
 	}
-	if (args.size < 0) {
-		args.size = 5;
-	}
-	if (data_rate < 0) {
-		if (args.size == 8) {
-			args.dmode = args.mfm ? MFM_500K : FM_500K;
-		} else if (args.size == 5) {
-			args.dmode = args.mfm ? MFM_250K : FM_250K;
-		} else {
-			args.dmode = MFM_250K; // punt
-		}
-	} else switch (data_rate) {
-		case 250:
-			args.dmode = args.mfm ? MFM_250K : FM_250K;
-			break;
-		case 300:
-			args.dmode = args.mfm ? MFM_300K : FM_300K;
-			break;
-		case 500:
-			args.dmode = args.mfm ? MFM_500K : FM_500K;
-			break;
-		case 1000:
-			args.dmode = MFM_1000K;
-			args.mfm = 1;
-			break;
-	}
-	if (args.offset1 < 0) {
-		args.offset1 = 1; // default to industry-standard
-	}
-	if (args.offset2 < 0) {
-		args.offset2 = args.offset1;
-	}
-	if (abs(skew) > 1) { // physical skew - if specified
-		args.sectbl = mkskew(skew, args.sectors);
-	}
-	if (abs(skew2) > 1) {
-		args.sectbl2 = mkskew(skew2, args.sectors);
+	if (args.delta != NULL && args.imd_filename == NULL) {
+		fprintf(stderr, "--delta requires IMAGE-FILE\n");
+		return 1;
 	}
-
 	process_raw();
 
 	return 0;
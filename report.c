@@ -0,0 +1,186 @@
+/*
+	report.c: streaming JSON lines / CBOR writer, see report.h
+*/
+
+#include "report.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_FALSE	0xf4
+#define CBOR_TRUE	0xf5
+#define CBOR_INDEF	31
+#define CBOR_BREAK	0xff
+
+void rp_init(report_t *r, FILE *out, bool cbor) {
+	memset(r, 0, sizeof(*r));
+	r->out = out;
+	r->cbor = cbor;
+}
+
+// CBOR head: major type and argument, in the shortest form
+static void cbor_head(report_t *r, int major, uint64_t v) {
+	uint8_t buf[9];
+	int n;
+	major <<= 5;
+	if (v < 24) {
+		buf[0] = major | v;
+		n = 1;
+	} else if (v <= 0xff) {
+		buf[0] = major | 24;
+		n = 2;
+	} else if (v <= 0xffff) {
+		buf[0] = major | 25;
+		n = 3;
+	} else if (v <= 0xffffffff) {
+		buf[0] = major | 26;
+		n = 5;
+	} else {
+		buf[0] = major | 27;
+		n = 9;
+	}
+	for (int i = n - 1; i > 0; --i) {
+		buf[i] = v;
+		v >>= 8;
+	}
+	fwrite(buf, 1, n, r->out);
+}
+
+// separator before a value (or key) in JSON
+static void value(report_t *r) {
+	if (!r->cbor) {
+		if (r->after_key) {
+			r->after_key = false;
+		} else if (r->depth > 0 && r->more[r->depth]) {
+			fputc(',', r->out);
+		}
+	}
+	r->more[r->depth] = true;
+}
+
+static void begin(report_t *r, const char *brackets, int major) {
+	value(r);
+	if (r->cbor) {
+		fputc((major << 5) | CBOR_INDEF, r->out);
+	} else {
+		fputc(brackets[0], r->out);
+	}
+	if (r->depth + 1 >= REPORT_DEPTH) {
+		die("report nested too deeply");
+	}
+	++r->depth;
+	r->more[r->depth] = false;
+	r->close[r->depth] = brackets[1];
+}
+
+void rp_begin_map(report_t *r) {
+	begin(r, "{}", CBOR_MAP);
+}
+
+void rp_begin_array(report_t *r) {
+	begin(r, "[]", CBOR_ARRAY);
+}
+
+// ends the innermost map or array, and the record at the top level
+void rp_end(report_t *r) {
+	if (r->cbor) {
+		fputc(CBOR_BREAK, r->out);
+	} else {
+		fputc(r->close[r->depth], r->out);
+	}
+	--r->depth;
+	if (r->depth == 0) {
+		r->more[0] = false;
+		if (!r->cbor) fputc('\n', r->out);
+		fflush(r->out);
+	}
+}
+
+/*
+ * JSON string literal. Bytes outside printable ASCII are escaped as the
+ * code points of the same value (i.e. read as Latin-1), so the output
+ * is ASCII and valid whatever the input bytes are.
+ */
+void json_string(FILE *out, const char *s, size_t len) {
+	fputc('"', out);
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20 || c >= 0x7f) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+void rp_key(report_t *r, const char *key) {
+	value(r);
+	if (r->cbor) {
+		cbor_head(r, CBOR_TEXT, strlen(key));
+		fputs(key, r->out);
+	} else {
+		json_string(r->out, key, strlen(key));
+		fputc(':', r->out);
+		r->after_key = true;
+	}
+}
+
+void rp_int(report_t *r, int64_t v) {
+	value(r);
+	if (r->cbor) {
+		if (v >= 0) {
+			cbor_head(r, CBOR_UINT, v);
+		} else {
+			cbor_head(r, CBOR_NEGINT, -1 - v);
+		}
+	} else {
+		fprintf(r->out, "%" PRId64, v);
+	}
+}
+
+void rp_bool(report_t *r, bool v) {
+	value(r);
+	if (r->cbor) {
+		fputc(v ? CBOR_TRUE : CBOR_FALSE, r->out);
+	} else {
+		fputs(v ? "true" : "false", r->out);
+	}
+}
+
+/*
+ * Text string, escaped by json_string() in JSON. CBOR gets the bytes
+ * as a byte string unless they are plain ASCII.
+ */
+void rp_string(report_t *r, const char *s, size_t len) {
+	value(r);
+	if (r->cbor) {
+		bool ascii = true;
+		for (size_t i = 0; i < len && ascii; ++i) {
+			ascii = (unsigned char)s[i] < 0x80;
+		}
+		cbor_head(r, ascii ? CBOR_TEXT : CBOR_BYTES, len);
+		fwrite(s, 1, len, r->out);
+	} else {
+		json_string(r->out, s, len);
+	}
+}
+
+// hashes are hex strings in JSON, which has no exact 64-bit integers
+void rp_hash(report_t *r, uint64_t h) {
+	value(r);
+	if (r->cbor) {
+		cbor_head(r, CBOR_UINT, h);
+	} else {
+		fprintf(r->out, "\"%016" PRIx64 "\"", h);
+	}
+}
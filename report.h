@@ -0,0 +1,42 @@
+/*
+	report.h: streaming structured output as JSON lines or CBOR
+
+	A report is a sequence of top-level records, each written as soon
+	as it is complete: one JSON value per line, or an RFC 8742 CBOR
+	sequence. Maps and arrays are written with indefinite lengths in
+	CBOR, so nothing needs to be counted up front.
+*/
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define REPORT_DEPTH	8
+
+typedef struct {
+	FILE *out;
+	bool cbor;
+	int depth;
+	bool more[REPORT_DEPTH];	// a value already written at this depth
+	char close[REPORT_DEPTH];	// JSON bracket that ends this depth
+	bool after_key;
+} report_t;
+
+void rp_init(report_t *r, FILE *out, bool cbor);
+void rp_begin_map(report_t *r);
+void rp_begin_array(report_t *r);
+void rp_end(report_t *r);
+void rp_key(report_t *r, const char *key);
+void rp_int(report_t *r, int64_t v);
+void rp_bool(report_t *r, bool v);
+void rp_string(report_t *r, const char *s, size_t len);
+void rp_hash(report_t *r, uint64_t h);
+
+// JSON string literal for any bytes; also used outside reports
+void json_string(FILE *out, const char *s, size_t len);
+
+#endif
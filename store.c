@@ -0,0 +1,226 @@
+/*
+	store.c: content-addressed IMD store, see store.h
+
+	An IMD file is cut at its record boundaries: the comment (with its
+	0x1A terminator) and each track record become chunks, keyed by a
+	128-bit hash of their bytes. A track chunk leaves out the leading
+	mode/cylinder/head bytes, which the recipe keeps instead, so that
+	e.g. blank tracks share one chunk wherever they appear on the disk.
+	Chunks are written once; replaying the recipe gives back the
+	original IMD byte for byte.
+*/
+
+#include "store.h"
+#include "hash.h"
+#include "imdfile.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECIPE_MAGIC	"IMDRECIPE 1"
+#define KEY_LEN		32
+
+static void make_dir(const char *path) {
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		die_errno("cannot create %s", path);
+	}
+}
+
+/*
+ * mkstemp() files are private (0600); a store may be shared between
+ * users, so make its files readable like those of open(2) with 0644.
+ */
+static int create_shared(char *tmpl) {
+	static mode_t mask = (mode_t)-1;
+	if (mask == (mode_t)-1) {
+		mask = umask(0);
+		umask(mask);
+	}
+	int fd = mkstemp(tmpl);
+	if (fd >= 0 && fchmod(fd, 0644 & ~mask) < 0) {
+		die_errno("cannot chmod %s", tmpl);
+	}
+	return fd;
+}
+
+static void chunk_key(const uint8_t *buf, size_t len, char *key) {
+	snprintf(key, KEY_LEN + 1, "%016" PRIx64 "%016" PRIx64,
+		hash64(buf, len, 0), hash64(buf, len, 0x9e3779b97f4a7c15ULL));
+}
+
+static void chunk_path(const char *dir, const char *key, char *path) {
+	snprintf(path, PATH_MAX, "%s/chunks/%.2s/%s", dir, key, key);
+}
+
+static bool same_contents(const char *path, const uint8_t *buf, size_t len) {
+	uint8_t tmp[4096];
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		die_errno("cannot open %s", path);
+	}
+	size_t off = 0;
+	bool same = true;
+	while (same) {
+		size_t n = fread(tmp, 1, sizeof(tmp), f);
+		if (n == 0) break;
+		if (off + n > len || memcmp(tmp, buf + off, n) != 0) {
+			same = false;
+		}
+		off += n;
+	}
+	fclose(f);
+	return same && off == len;
+}
+
+/*
+ * Stores one chunk unless already present. Returns true if it was new.
+ * An existing chunk with different contents (a hash collision) is fatal.
+ */
+static bool put_chunk(const char *dir, const uint8_t *buf, size_t len,
+			char *key) {
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	struct stat stb;
+
+	chunk_key(buf, len, key);
+	chunk_path(dir, key, path);
+	if (stat(path, &stb) == 0) {
+		if (!same_contents(path, buf, len)) {
+			die("%s: hash collision", path);
+		}
+		return false;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/chunks/%.2s", dir, key);
+	make_dir(tmp);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = create_shared(tmp);
+	if (fd < 0) {
+		die_errno("cannot create %s", tmp);
+	}
+	if (write(fd, buf, len) != (ssize_t)len || close(fd) < 0) {
+		die_errno("cannot write %s", tmp);
+	}
+	// concurrent writers of the same chunk produce identical files
+	if (rename(tmp, path) < 0) {
+		die_errno("cannot rename %s", tmp);
+	}
+	return true;
+}
+
+void store_imd(const char *dir, const char *imd_path, const char *name,
+		bool verbose) {
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	char key[KEY_LEN + 1];
+	imd_file_t imd;
+	imd_track_t trk;
+	int chunks = 0;
+	int fresh = 0;
+	size_t stored = 0;
+
+	make_dir(dir);
+	snprintf(path, sizeof(path), "%s/chunks", dir);
+	make_dir(path);
+	snprintf(path, sizeof(path), "%s/recipes", dir);
+	make_dir(path);
+	snprintf(path, sizeof(path), "%s/recipes/%s", dir, name);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = create_shared(tmp);
+	FILE *recipe = fd < 0 ? NULL : fdopen(fd, "w");
+	if (recipe == NULL) {
+		die_errno("cannot create %s", tmp);
+	}
+	fprintf(recipe, "%s\n", RECIPE_MAGIC);
+
+	imd_open(&imd, imd_path);
+	if (put_chunk(dir, imd.buf, imd.comment_len + 1, key)) {
+		++fresh;
+		stored += imd.comment_len + 1;
+	}
+	++chunks;
+	fprintf(recipe, "comment %s %zu\n", key, imd.comment_len + 1);
+	while (imd_next_track(&imd, &trk)) {
+		if (put_chunk(dir, trk.start + 3, trk.len - 3, key)) {
+			++fresh;
+			stored += trk.len - 3;
+		}
+		++chunks;
+		fprintf(recipe, "track %s %zu %d %d %d\n", key, trk.len - 3,
+			trk.start[0], trk.start[1], trk.start[2]);
+	}
+	if (fclose(recipe) != 0) {
+		die_errno("cannot write %s", tmp);
+	}
+	if (rename(tmp, path) < 0) {
+		die_errno("cannot rename %s", tmp);
+	}
+	if (verbose) {
+		printf("%s: %d chunks, %d new, %zu of %zu bytes stored\n",
+			name, chunks, fresh, stored, imd.len);
+	}
+	imd_close(&imd);
+}
+
+void restore_imd(const char *dir, const char *name, const char *out_path) {
+	char path[PATH_MAX];
+	char cpath[PATH_MAX];
+	char line[256];
+	char key[KEY_LEN + 1];
+	uint8_t buf[4096];
+
+	snprintf(path, sizeof(path), "%s/recipes/%s", dir, name);
+	FILE *recipe = fopen(path, "r");
+	if (recipe == NULL) {
+		die_errno("cannot open %s", path);
+	}
+	if (fgets(line, sizeof(line), recipe) == NULL ||
+			strncmp(line, RECIPE_MAGIC, strlen(RECIPE_MAGIC)) != 0) {
+		die("%s: not a recipe", path);
+	}
+	FILE *out = fopen(out_path, "wb");
+	if (out == NULL) {
+		die_errno("cannot open %s", out_path);
+	}
+	while (fgets(line, sizeof(line), recipe) != NULL) {
+		size_t len;
+		int hdr[3];
+		int n = sscanf(line, "%*s %32s %zu %d %d %d", key, &len,
+				&hdr[0], &hdr[1], &hdr[2]);
+		if (strncmp(line, "track ", 6) == 0 && n == 5) {
+			for (int i = 0; i < 3; ++i) {
+				fputc(hdr[i], out);
+			}
+		} else if (strncmp(line, "comment ", 8) != 0 || n != 2) {
+			die("%s: bad recipe line: %s", path, line);
+		}
+		chunk_path(dir, key, cpath);
+		FILE *chunk = fopen(cpath, "rb");
+		if (chunk == NULL) {
+			die_errno("cannot open %s", cpath);
+		}
+		size_t total = 0;
+		size_t got;
+		while ((got = fread(buf, 1, sizeof(buf), chunk)) > 0) {
+			fwrite(buf, 1, got, out);
+			total += got;
+		}
+		fclose(chunk);
+		if (total != len) {
+			die("%s: chunk is %zu bytes, expected %zu",
+				cpath, total, len);
+		}
+	}
+	fclose(recipe);
+	if (fclose(out) != 0) {
+		die_errno("cannot write %s", out_path);
+	}
+}
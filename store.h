@@ -0,0 +1,17 @@
+/*
+	store.h: content-addressed, track-deduplicated IMD store
+
+	DIR/chunks/XX/KEY	unique IMD records (comment, tracks)
+	DIR/recipes/NAME	ordered list of chunk keys for image NAME
+*/
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+
+void store_imd(const char *dir, const char *imd_path, const char *name,
+		bool verbose);
+void restore_imd(const char *dir, const char *name, const char *out_path);
+
+#endif
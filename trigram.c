@@ -0,0 +1,438 @@
+/*
+	trigram.c: inverted trigram index, see trigram.h
+
+	Index file layout (host byte order, all sections 8-byte aligned
+	so the file can be used in place from a mapping):
+		tg_header_t
+		image names, NUL-terminated
+		tg_loc_t[nlocs]		sector locations
+		tg_dir_t[ntrigrams]	sorted by trigram
+		postings		per trigram: ascending location ids,
+					delta coded as LEB128 varints
+*/
+
+#include "trigram.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TG_MAGIC	"IMDTGI1"
+
+typedef struct {
+	char magic[8];
+	uint32_t nimages;
+	uint32_t nlocs;
+	uint32_t ntrigrams;
+	uint32_t names_len;	// padded to 8
+	uint64_t postings_len;
+} tg_header_t;
+
+typedef struct {
+	uint32_t image;
+	uint16_t cyl;
+	uint8_t head;
+	uint8_t sector;		// logical sector number
+} tg_loc_t;
+
+typedef struct {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t offset;	// into postings
+} tg_dir_t;
+
+struct tg_builder {
+	char *name;
+	tg_loc_t *locs;
+	uint32_t nlocs;
+	uint32_t max_locs;
+	uint64_t *ents;		// trigram << 32 | location id
+	size_t nents;
+	size_t max_ents;
+};
+
+static void *grow(void *p, size_t *max, size_t need, size_t size) {
+	if (need <= *max) return p;
+	while (*max < need) {
+		*max = *max ? *max * 2 : 4096;
+	}
+	p = realloc(p, *max * size);
+	if (p == NULL) {
+		die("out of memory");
+	}
+	return p;
+}
+
+static inline uint8_t fold(uint8_t c) {
+	return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+tg_builder_t *tg_new(const char *image_name) {
+	tg_builder_t *tg = calloc(1, sizeof(*tg));
+	if (tg == NULL || (tg->name = strdup(image_name)) == NULL) {
+		die("out of memory");
+	}
+	return tg;
+}
+
+void tg_free(tg_builder_t *tg) {
+	free(tg->name);
+	free(tg->locs);
+	free(tg->ents);
+	free(tg);
+}
+
+void tg_add_sector(tg_builder_t *tg, int cyl, int head, int sector,
+			const uint8_t *data, int len) {
+	size_t max = tg->max_locs;
+	tg->locs = grow(tg->locs, &max, tg->nlocs + 1, sizeof(tg_loc_t));
+	tg->max_locs = max;
+	uint32_t id = tg->nlocs++;
+	tg->locs[id] = (tg_loc_t){ 0, cyl, head, sector };
+	if (len < 3) return;
+	tg->ents = grow(tg->ents, &tg->max_ents, tg->nents + len - 2,
+			sizeof(uint64_t));
+	uint32_t t = (fold(data[0]) << 8) | fold(data[1]);
+	for (int i = 2; i < len; ++i) {
+		t = ((t << 8) | fold(data[i])) & 0xffffff;
+		tg->ents[tg->nents++] = ((uint64_t)t << 32) | id;
+	}
+}
+
+// LSD radix sort on the 56 significant bits
+static void sort_ents(uint64_t *a, size_t n) {
+	uint64_t *tmp = malloc(n * sizeof(*a));
+	if (n > 0 && tmp == NULL) {
+		die("out of memory");
+	}
+	for (int shift = 0; shift < 56; shift += 8) {
+		size_t count[257] = { 0 };
+		for (size_t i = 0; i < n; ++i) {
+			++count[((a[i] >> shift) & 0xff) + 1];
+		}
+		if (count[1] == n) continue;	// byte is always zero
+		for (int b = 0; b < 256; ++b) {
+			count[b + 1] += count[b];
+		}
+		for (size_t i = 0; i < n; ++i) {
+			tmp[count[(a[i] >> shift) & 0xff]++] = a[i];
+		}
+		memcpy(a, tmp, n * sizeof(*a));
+	}
+	free(tmp);
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	size_t max;
+} bytes_t;
+
+static void put_varint(bytes_t *b, uint32_t v) {
+	b->buf = grow(b->buf, &b->max, b->len + 5, 1);
+	while (v >= 0x80) {
+		b->buf[b->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	b->buf[b->len++] = v;
+}
+
+static uint32_t get_varint(const uint8_t **p) {
+	uint32_t v = 0;
+	int shift = 0;
+	while (**p & 0x80) {
+		v |= (uint32_t)(*(*p)++ & 0x7f) << shift;
+		shift += 7;
+	}
+	v |= (uint32_t)*(*p)++ << shift;
+	return v;
+}
+
+typedef struct {
+	tg_dir_t *dir;
+	size_t ndir;
+	size_t max_dir;
+	bytes_t post;
+	uint32_t last;		// previous location id in current list
+} tg_out_t;
+
+static void out_trigram(tg_out_t *o, uint32_t t) {
+	o->dir = grow(o->dir, &o->max_dir, o->ndir + 1, sizeof(tg_dir_t));
+	o->dir[o->ndir++] = (tg_dir_t){ t, 0, o->post.len };
+	o->last = 0;
+}
+
+static void out_loc(tg_out_t *o, uint32_t id) {
+	tg_dir_t *d = &o->dir[o->ndir - 1];
+	put_varint(&o->post, d->count ? id - o->last : id);
+	o->last = id;
+	++d->count;
+}
+
+static void write_index(const char *path, const char *names, size_t names_len,
+		uint32_t nimages, const tg_loc_t *locs, uint32_t nlocs,
+		tg_out_t *o) {
+	static const uint8_t zero[8];
+	tg_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TG_MAGIC, sizeof(TG_MAGIC));
+	hdr.nimages = nimages;
+	hdr.nlocs = nlocs;
+	hdr.ntrigrams = o->ndir;
+	hdr.names_len = (names_len + 7) & ~7;
+	hdr.postings_len = o->post.len;
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		die_errno("cannot open %s", path);
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(names, 1, names_len, f);
+	fwrite(zero, 1, hdr.names_len - names_len, f);
+	fwrite(locs, sizeof(*locs), nlocs, f);
+	fwrite(o->dir, sizeof(*o->dir), o->ndir, f);
+	fwrite(o->post.buf, 1, o->post.len, f);
+	if (fclose(f) != 0) {
+		die_errno("cannot write %s", path);
+	}
+	free(o->dir);
+	free(o->post.buf);
+}
+
+void tg_write(tg_builder_t *tg, const char *path) {
+	tg_out_t o;
+	memset(&o, 0, sizeof(o));
+	sort_ents(tg->ents, tg->nents);
+	for (size_t i = 0; i < tg->nents; ++i) {
+		uint64_t e = tg->ents[i];
+		if (i > 0 && e == tg->ents[i - 1]) continue;
+		uint32_t t = e >> 32;
+		if (o.ndir == 0 || o.dir[o.ndir - 1].trigram != t) {
+			out_trigram(&o, t);
+		}
+		out_loc(&o, (uint32_t)e);
+	}
+	write_index(path, tg->name, strlen(tg->name) + 1, 1,
+			tg->locs, tg->nlocs, &o);
+}
+
+typedef struct {
+	const char *path;
+	uint8_t *map;
+	size_t len;
+	const tg_header_t *hdr;
+	const char *names;
+	const tg_loc_t *locs;
+	const tg_dir_t *dir;
+	const uint8_t *post;
+} tg_index_t;
+
+static void map_index(const char *path, tg_index_t *x) {
+	struct stat stb;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stb) < 0) {
+		die_errno("cannot open %s", path);
+	}
+	x->path = path;
+	x->len = stb.st_size;
+	if (x->len < sizeof(tg_header_t)) {
+		die("%s: not a trigram index", path);
+	}
+	x->map = mmap(NULL, x->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (x->map == MAP_FAILED) {
+		die_errno("cannot map %s", path);
+	}
+	close(fd);
+	x->hdr = (const tg_header_t *)x->map;
+	const tg_header_t *h = x->hdr;
+	size_t locs_len = (size_t)h->nlocs * sizeof(tg_loc_t);
+	if (memcmp(h->magic, TG_MAGIC, sizeof(TG_MAGIC)) != 0 ||
+			x->len != sizeof(*h) + h->names_len + locs_len +
+			(size_t)h->ntrigrams * sizeof(tg_dir_t) +
+			h->postings_len) {
+		die("%s: not a trigram index", path);
+	}
+	x->names = (const char *)(x->map + sizeof(*h));
+	x->locs = (const tg_loc_t *)(x->names + h->names_len);
+	x->dir = (const tg_dir_t *)((const uint8_t *)x->locs + locs_len);
+	x->post = (const uint8_t *)(x->dir + h->ntrigrams);
+}
+
+static void unmap_index(tg_index_t *x) {
+	munmap(x->map, x->len);
+}
+
+/*
+ * Merges indexes; image and location ids of each input are offset
+ * past those of the inputs before it, so posting lists stay sorted
+ * when concatenated.
+ */
+void tg_merge(const char *out_path, int nidx, char **idx_paths) {
+	tg_index_t *x = calloc(nidx, sizeof(*x));
+	size_t *pos = calloc(nidx, sizeof(*pos));
+	uint32_t *loc_base = calloc(nidx, sizeof(*loc_base));
+	if (x == NULL || pos == NULL || loc_base == NULL) {
+		die("out of memory");
+	}
+	bytes_t names = { NULL, 0, 0 };
+	tg_loc_t *locs = NULL;
+	size_t max_locs = 0;
+	uint32_t nlocs = 0;
+	uint32_t nimages = 0;
+
+	for (int i = 0; i < nidx; ++i) {
+		map_index(idx_paths[i], &x[i]);
+		const tg_header_t *h = x[i].hdr;
+		const char *n = x[i].names;
+		for (uint32_t k = 0; k < h->nimages; ++k) {
+			size_t l = strlen(n) + 1;
+			names.buf = grow(names.buf, &names.max, names.len + l, 1);
+			memcpy(names.buf + names.len, n, l);
+			names.len += l;
+			n += l;
+		}
+		locs = grow(locs, &max_locs, nlocs + h->nlocs, sizeof(*locs));
+		for (uint32_t k = 0; k < h->nlocs; ++k) {
+			locs[nlocs + k] = x[i].locs[k];
+			locs[nlocs + k].image += nimages;
+		}
+		loc_base[i] = nlocs;
+		nlocs += h->nlocs;
+		nimages += h->nimages;
+	}
+
+	tg_out_t o;
+	memset(&o, 0, sizeof(o));
+	while (true) {
+		// next smallest trigram across inputs
+		uint32_t t = UINT32_MAX;
+		for (int i = 0; i < nidx; ++i) {
+			if (pos[i] < x[i].hdr->ntrigrams &&
+					x[i].dir[pos[i]].trigram < t) {
+				t = x[i].dir[pos[i]].trigram;
+			}
+		}
+		if (t == UINT32_MAX) break;
+		out_trigram(&o, t);
+		for (int i = 0; i < nidx; ++i) {
+			if (pos[i] >= x[i].hdr->ntrigrams ||
+					x[i].dir[pos[i]].trigram != t) {
+				continue;
+			}
+			const tg_dir_t *d = &x[i].dir[pos[i]++];
+			const uint8_t *p = x[i].post + d->offset;
+			uint32_t id = 0;
+			for (uint32_t k = 0; k < d->count; ++k) {
+				id = k ? id + get_varint(&p) : get_varint(&p);
+				out_loc(&o, loc_base[i] + id);
+			}
+		}
+	}
+	write_index(out_path, (const char *)names.buf, names.len, nimages,
+			locs, nlocs, &o);
+	for (int i = 0; i < nidx; ++i) {
+		unmap_index(&x[i]);
+	}
+	free(names.buf);
+	free(locs);
+	free(loc_base);
+	free(pos);
+	free(x);
+}
+
+static const tg_dir_t *find_trigram(const tg_index_t *x, uint32_t t) {
+	size_t lo = 0;
+	size_t hi = x->hdr->ntrigrams;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (x->dir[mid].trigram < t) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < x->hdr->ntrigrams && x->dir[lo].trigram == t) {
+		return &x->dir[lo];
+	}
+	return NULL;
+}
+
+static const char **image_names(const tg_index_t *x) {
+	const char **names = malloc(x->hdr->nimages * sizeof(*names) + 1);
+	if (names == NULL) {
+		die("out of memory");
+	}
+	const char *n = x->names;
+	for (uint32_t i = 0; i < x->hdr->nimages; ++i) {
+		names[i] = n;
+		n += strlen(n) + 1;
+	}
+	return names;
+}
+
+/*
+ * Prints "image cyl head sector" for each sector containing all
+ * trigrams of 'pattern' (case-insensitive for ASCII letters).
+ * Returns the number of hits.
+ */
+int tg_query(int nidx, char **idx_paths, const char *pattern, FILE *out) {
+	size_t plen = strlen(pattern);
+	int hits = 0;
+	if (plen < 3) {
+		die("search string must be at least 3 bytes");
+	}
+	for (int i = 0; i < nidx; ++i) {
+		tg_index_t x;
+		map_index(idx_paths[i], &x);
+		uint32_t *cand = NULL;
+		size_t ncand = 0;
+		for (size_t k = 0; k + 2 < plen; ++k) {
+			uint32_t t = (fold(pattern[k]) << 16) |
+				(fold(pattern[k + 1]) << 8) | fold(pattern[k + 2]);
+			const tg_dir_t *d = find_trigram(&x, t);
+			if (d == NULL) {
+				ncand = 0;
+				break;
+			}
+			const uint8_t *p = x.post + d->offset;
+			uint32_t id = 0;
+			if (cand == NULL) {
+				cand = malloc(d->count * sizeof(*cand));
+				if (d->count > 0 && cand == NULL) {
+					die("out of memory");
+				}
+				for (uint32_t j = 0; j < d->count; ++j) {
+					id = j ? id + get_varint(&p) : get_varint(&p);
+					cand[ncand++] = id;
+				}
+				continue;
+			}
+			// intersect the sorted candidate list in place
+			size_t n = 0;
+			size_t c = 0;
+			for (uint32_t j = 0; j < d->count && c < ncand; ++j) {
+				id = j ? id + get_varint(&p) : get_varint(&p);
+				while (c < ncand && cand[c] < id) ++c;
+				if (c < ncand && cand[c] == id) {
+					cand[n++] = id;
+					++c;
+				}
+			}
+			ncand = n;
+			if (ncand == 0) break;
+		}
+		const char **names = image_names(&x);
+		for (size_t k = 0; k < ncand; ++k) {
+			const tg_loc_t *l = &x.locs[cand[k]];
+			fprintf(out, "%s %d %d %d\n", names[l->image],
+				l->cyl, l->head, l->sector);
+		}
+		free(names);
+		hits += ncand;
+		free(cand);
+		unmap_index(&x);
+	}
+	return hits;
+}
@@ -0,0 +1,27 @@
+/*
+	trigram.h: inverted trigram index over sector contents
+
+	Maps each 3-byte sequence (ASCII letters folded to upper case) to
+	the sectors containing it. An index covers one or more images and
+	can be merged with others; queries return candidate sectors that
+	contain every trigram of the search string.
+*/
+
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct tg_builder tg_builder_t;
+
+tg_builder_t *tg_new(const char *image_name);
+void tg_add_sector(tg_builder_t *tg, int cyl, int head, int sector,
+			const uint8_t *data, int len);
+void tg_write(tg_builder_t *tg, const char *path);
+void tg_free(tg_builder_t *tg);
+
+void tg_merge(const char *out_path, int nidx, char **idx_paths);
+int tg_query(int nidx, char **idx_paths, const char *pattern, FILE *out);
+
+#endif